@@ -0,0 +1,42 @@
+#!/bin/sh
+# Runs every benchmark script against two clox binaries and prints the elapsed time each one reports.
+#
+#   ./compare.sh <baseline clox> <candidate clox> [runs]
+#
+# Build the binaries with DEBUG_PRINT_CODE and DEBUG_TRACE_EXECUTION turned off in common.h, otherwise the
+# disassembly output dominates the timings. E.g. comparing the two Value representations:
+#
+#   cmake -S .. -B tagged -DCMAKE_BUILD_TYPE=Release -DCLOX_NAN_BOXING=OFF && cmake --build tagged
+#   cmake -S .. -B boxed  -DCMAKE_BUILD_TYPE=Release -DCLOX_NAN_BOXING=ON  && cmake --build boxed
+#   ./compare.sh tagged/clox boxed/clox
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <baseline clox> <candidate clox> [runs]" >&2
+    exit 64
+fi
+
+BASELINE=$1
+CANDIDATE=$2
+RUNS=${3:-3}
+DIR=$(dirname "$0")
+
+# The last line a benchmark prints is its elapsed time. Keep the fastest of RUNS runs.
+best() {
+    fastest=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        t=$("$1" "$2" | tail -n 1)
+        if [ -z "$fastest" ] || awk "BEGIN { exit !($t < $fastest) }"; then
+            fastest=$t
+        fi
+        i=$((i + 1))
+    done
+    echo "$fastest"
+}
+
+printf "%-24s %12s %12s %8s\n" "benchmark" "baseline" "candidate" "speedup"
+for script in "$DIR"/*.lox; do
+    a=$(best "$BASELINE" "$script")
+    b=$(best "$CANDIDATE" "$script")
+    printf "%-24s %12.4f %12.4f %7.2fx\n" "$(basename "$script" .lox)" "$a" "$b" "$(awk "BEGIN { print $a / $b }")"
+done
@@ -11,6 +11,9 @@ void initChunk(Chunk* chunk) {
     chunk->lineCapacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -49,9 +52,21 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     lineStart->line = line;
 }
 
+// Drops the code from `count` on, along with its line information. The compiler uses this to take back code it has
+// folded or found to be dead. Nothing may jump into the dropped code.
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
+}
+
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    // A chunk loaded from an image runs its code and line table straight from the mapped file (see image.c). They have
+    // no capacity and aren't ours to free.
+    if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->lineCapacity > 0) FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -63,17 +78,21 @@ int addConstant(Chunk* chunk, Value value) {
     return chunk->constants.count - 1;
 }
 
-void writeConstant(Chunk* chunk, Value value, int line) {
-    int constantIndex = addConstant(chunk, value);
-    if (constantIndex < 256) {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, (uint8_t)constantIndex, line);
-    } else {
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
-        writeChunk(chunk, (uint8_t)(constantIndex & 0xff), line);
-        writeChunk(chunk, (uint8_t)((constantIndex >> 8) & 0xff), line);
-        writeChunk(chunk, (uint8_t)((constantIndex >> 16) & 0xff), line);
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->ways[i].shape = NULL;
+        cache->ways[i].transition = NULL;
+        cache->ways[i].fieldSlot = -1;
+        cache->ways[i].method = NULL;
     }
+    return chunk->cacheCount++;
 }
 
 // chunk.c
@@ -5,11 +5,15 @@
 
 typedef enum {
     OP_CONSTANT,
-    OP_CONSTANT_LONG,
+    // A prefix: the instruction after it has a 16-bit first operand instead of an 8-bit one, for constants, locals and
+    // upvalues past the first 256. OP_CLOSURE's upvalue indexes are widened too. Only the compiler decides to use it,
+    // so the instructions themselves don't get any slower.
+    OP_WIDE,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GET_SUPER,
     OP_DEFINE_GLOBAL,
     OP_SET_GLOBAL,
@@ -21,6 +25,8 @@ typedef enum {
     OP_POP,
     OP_GREATER,
     OP_LESS,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -43,6 +49,53 @@ typedef enum {
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_DEL_PROPERTY,
+    OP_GET_METHOD,
+    OP_GET_SUPER_METHOD,
+    OP_CALL_METHOD,
+    // Superinstructions. The compiler never emits these directly; the peephole pass fuses them out of the sequences
+    // noted in peephole.c.
+    OP_ADD_LOCALS,
+    OP_ADD_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_LESS_JUMP_IF_FALSE,
+    // Register instructions, only emitted in REGISTER_BYTECODE builds by translateRegisters() in peephole.c. Their
+    // operands are frame slots, which hold both locals and the temporaries of the expression being evaluated, or
+    // constants. OP_MOVE and OP_LOAD_CONSTANT copy a slot or a constant into a local. The first operand of each
+    // arithmetic instruction is the slot the result goes in, then come the left operand's slot and either the right
+    // operand's slot (RR) or a constant (RK). The plain forms leave the result as the new top of the stack; the _SET
+    // forms store it into a local and leave the stack alone.
+    OP_MOVE,
+    OP_LOAD_CONSTANT,
+    OP_ADD_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RR,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RR,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RR,
+    OP_DIVIDE_RK,
+    OP_ADD_RR_SET,
+    OP_ADD_RK_SET,
+    OP_SUBTRACT_RR_SET,
+    OP_SUBTRACT_RK_SET,
+    OP_MULTIPLY_RR_SET,
+    OP_MULTIPLY_RK_SET,
+    OP_DIVIDE_RR_SET,
+    OP_DIVIDE_RK_SET,
+    // Compare two operands and jump if the comparison is false, pushing the false result the way OP_LESS_JUMP_IF_FALSE
+    // does.
+    OP_EQUAL_RR_JUMP_IF_FALSE,
+    OP_EQUAL_RK_JUMP_IF_FALSE,
+    OP_NOT_EQUAL_RR_JUMP_IF_FALSE,
+    OP_NOT_EQUAL_RK_JUMP_IF_FALSE,
+    OP_LESS_RR_JUMP_IF_FALSE,
+    OP_LESS_RK_JUMP_IF_FALSE,
+    OP_LESS_EQUAL_RR_JUMP_IF_FALSE,
+    OP_LESS_EQUAL_RK_JUMP_IF_FALSE,
+    OP_GREATER_RR_JUMP_IF_FALSE,
+    OP_GREATER_RK_JUMP_IF_FALSE,
+    OP_GREATER_EQUAL_RR_JUMP_IF_FALSE,
+    OP_GREATER_EQUAL_RK_JUMP_IF_FALSE,
 } OpCode;
 
 typedef struct {
@@ -50,6 +103,27 @@ typedef struct {
     int line;
 } LineStart;
 
+#define INLINE_CACHE_WAYS 4
+
+// What a property instruction found the last time it saw a receiver with shape `shape`: either a field stored at
+// `fieldSlot` in the instance's field array, or a method on the class. A shape belongs to a single class and fixes
+// which fields an instance has, so the shape alone is enough to validate a hit.
+//
+// For OP_SET_PROPERTY, a non-NULL `transition` means the set added a new field: the value goes in `fieldSlot` and the
+// instance moves on to the `transition` shape.
+typedef struct {
+    ObjShape* shape;
+    ObjShape* transition;
+    int fieldSlot; // -1 if the property is a method.
+    ObjClosure* method;
+} CacheWay;
+
+// Every OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE gets its own inline cache in the chunk, identified by a 16-bit
+// operand. A cache remembers up to INLINE_CACHE_WAYS receiver shapes, most recently used first.
+typedef struct {
+    CacheWay ways[INLINE_CACHE_WAYS];
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
@@ -58,13 +132,17 @@ typedef struct {
     int lineCount;
     int lineCapacity;
     LineStart* lines;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
-void writeConstant(Chunk* chunk, Value value, int line);
+void truncateChunk(Chunk* chunk, int count);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 int getLine(Chunk* chunk, int offset);
 
 
@@ -9,11 +9,16 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// NAN_BOXING is controlled by the CLOX_NAN_BOXING build option (see CMakeLists.txt) so both Value representations can
+// be built from the same tree and benchmarked against each other.
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_STATS
 // #define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif //CLOX_COMMON_H
@@ -12,12 +12,14 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "chunk.h"
+#include "memory.h"
+#include "peephole.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 
 #include "debug.h"
 #include "object.h"
-#include "memory.h"
 
 #endif
 
@@ -26,6 +28,11 @@ typedef struct {
     Token previous;
     bool hadError;
     bool panicMode;
+    int depth;     // How many parsePrecedence() calls deep the parser is.
+    int getOffset; // Where the last plain property get or super get was emitted, and at what depth. See grouping().
+    int getDepth;
+    int constantOffset; // Where the last literal was emitted, and at what depth. See constantAt().
+    int constantDepth;
 } Parser;
 
 typedef enum {
@@ -57,7 +64,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -72,9 +79,12 @@ typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    // Both arrays grow as needed, up to UINT16_COUNT entries, since OP_WIDE gives local and upvalue indexes 16 bits.
+    Local* locals;
     int localCount;
-    Upvalue upvalues[UINT8_COUNT];
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int scopeDepth;
 } Compiler;
 
@@ -83,6 +93,14 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
+// Where the current chunk's code, constants and inline caches end, so that code compiled after it can be taken back
+// with everything it added. See discardSince().
+typedef struct {
+    int code;
+    int constants;
+    int caches;
+} CodeMark;
+
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
@@ -155,6 +173,22 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitInlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+    emitByte(instruction);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -185,18 +219,30 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    return constant;
+}
+
+// Emits an instruction whose first operand is a constant, local or upvalue index. Almost every index fits in a byte;
+// the rest get the OP_WIDE prefix and two bytes.
+static void emitIndexed(uint8_t instruction, int index) {
+    if (index > UINT8_MAX) {
+        emitBytes(OP_WIDE, instruction);
+        emitByte((index >> 8) & 0xff);
+        emitByte(index & 0xff);
+    } else {
+        emitBytes(instruction, (uint8_t)index);
+    }
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(int offset) {
@@ -214,16 +260,149 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+// Takes back the code emitted from `offset` on, for an expression that's been folded or a statement that can't run.
+static void discardCode(int offset) {
+    truncateChunk(currentChunk(), offset);
+    parser.constantOffset = -1;
+    parser.getOffset = -1;
+}
+
+static CodeMark markCode() {
+    Chunk* chunk = currentChunk();
+    return (CodeMark){chunk->count, chunk->constants.count, chunk->cacheCount};
+}
+
+// Takes back the code compiled since `mark`, along with the constants and inline caches nothing else can use, so dead
+// code doesn't eat into the constant budget or get written into images. Upvalues it captured are still captured,
+// though: the function keeps them and the enclosing locals get closed rather than popped. That only costs a little.
+static void discardSince(CodeMark mark) {
+    Chunk* chunk = currentChunk();
+    discardCode(mark.code);
+    chunk->constants.count = mark.constants;
+    chunk->cacheCount = mark.caches;
+}
+
+// Called just before a literal is emitted. Like getOffset, the depth is that of the parsePrecedence() call whose prefix
+// rule emitted it, so an operator can tell the literal is its whole operand.
+static void markConstant(int offset) {
+    parser.constantOffset = offset;
+    parser.constantDepth = parser.depth;
+}
+
+// If everything the parsePrecedence() call at `depth` compiled is a single literal, stores its value and returns true.
+// An operator whose operands are all literals can then be folded into one.
+static bool constantAt(int depth, Value* value) {
+    Chunk* chunk = currentChunk();
+    int offset = parser.constantOffset;
+    if (parser.constantDepth != depth || offset < 0 || offset >= chunk->count) return false;
+
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+            *value = NIL_VAL;
+            return offset + 1 == chunk->count;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return offset + 1 == chunk->count;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return offset + 1 == chunk->count;
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[offset + 1]];
+            return offset + 2 == chunk->count;
+        case OP_WIDE:
+            if (chunk->code[offset + 1] != OP_CONSTANT) return false;
+            *value = chunk->constants.values[(chunk->code[offset + 2] << 8) | chunk->code[offset + 3]];
+            return offset + 4 == chunk->count;
+        default:
+            return false;
+    }
+}
+
+// Passes the literal the enclosed expression at `depth + 1` compiled to up to `depth`, for parentheses and for the
+// operand a short-circuiting operator turned out to be.
+static void liftConstant(int depth) {
+    Value value;
+    if (constantAt(depth + 1, &value)) parser.constantDepth = depth;
+}
+
+// A folded operand's constant is normally the last one added to the pool, and nothing else uses it, so it can go.
+static void dropConstant(int offset) {
+    Chunk* chunk = currentChunk();
+    int constant;
+    if (chunk->code[offset] == OP_CONSTANT) {
+        constant = chunk->code[offset + 1];
+    } else if (chunk->code[offset] == OP_WIDE && chunk->code[offset + 1] == OP_CONSTANT) {
+        constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    } else {
+        return;
+    }
+    if (constant == chunk->constants.count - 1) chunk->constants.count--;
+}
+
+// Replaces the operands' code, from `offset` on, with a literal for the folded result.
+static void emitFolded(int offset, int rightOffset, Value value) {
+    if (rightOffset != -1) dropConstant(rightOffset);
+    dropConstant(offset);
+    discardCode(offset);
+
+    markConstant(offset);
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+// Like the VM's own arrays, these are only the compiler's business and never seen by the collector, so they're
+// allocated directly rather than through reallocate().
+static Local* pushLocal(Compiler* compiler) {
+    if (compiler->localCount == compiler->localCapacity) {
+        compiler->localCapacity = GROW_CAPACITY(compiler->localCapacity);
+        compiler->locals = (Local*)realloc(compiler->locals, sizeof(Local) * compiler->localCapacity);
+        if (compiler->locals == NULL) exit(1);
+    }
+    return &compiler->locals[compiler->localCount++];
+}
+
+static Upvalue* pushUpvalue(Compiler* compiler) {
+    int count = compiler->function->upvalueCount;
+    if (count == compiler->upvalueCapacity) {
+        compiler->upvalueCapacity = GROW_CAPACITY(compiler->upvalueCapacity);
+        compiler->upvalues = (Upvalue*)realloc(compiler->upvalues, sizeof(Upvalue) * compiler->upvalueCapacity);
+        if (compiler->upvalues == NULL) exit(1);
+    }
+    compiler->function->upvalueCount++;
+    return &compiler->upvalues[count];
+}
+
+// Forgets the property get and the literal the parser last saw emitted, for when the chunk they were emitted into
+// changes.
+static void forgetOffsets() {
+    parser.getOffset = -1;
+    parser.getDepth = -1;
+    parser.constantOffset = -1;
+    parser.constantDepth = -1;
+}
+
 static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
 
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
     compiler->function = newFunction();
 
     current = compiler;
+    // The parser's offsets into the enclosing function's chunk mean nothing in this one's, and this one's mean nothing
+    // once it ends (see endCompiler()).
+    forgetOffsets();
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
@@ -231,7 +410,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     // When we're executing our program over in the VM, we store the function currently being executed in the first
     // slot (position 0) on the stack. That's why we're incrementing the local count here and creating a "dummy" local
     // value with an empty name so that it can never be resolved.
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -243,9 +422,23 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+// The upvalues array outlives this: function() still needs it to emit OP_CLOSURE, and frees it after.
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    free(current->locals);
+    current->locals = NULL;
+    if (!parser.hadError) {
+#ifdef REGISTER_BYTECODE
+        // Register code never needs more slots than the stack code it's translated from.
+        function->maxSlots = maxStackDepth(currentChunk(), function->arity);
+        translateRegisters(currentChunk(), function->arity);
+        peepholeOptimize(currentChunk());
+#else
+        peepholeOptimize(currentChunk());
+        function->maxSlots = maxStackDepth(currentChunk(), function->arity);
+#endif
+    }
 
 #ifdef DEBUG_PRINT_CODE
     const char *name = function->name != NULL ? function->name->chars : "<script>";
@@ -254,6 +447,7 @@ static ObjFunction* endCompiler() {
 #endif
 
     current = current->enclosing;
+    forgetOffsets();
     return function;
 }
 
@@ -279,18 +473,70 @@ static ParseRule *getRule(TokenType type);
 static void statement();
 static void declaration();
 static void parsePrecedence(Precedence precedence);
-static uint8_t identifierConstant(Token *name);
+static int identifierConstant(Token *name);
+static uint16_t globalVariable(Token* name);
 static int resolveLocal(Compiler* compiler, Token* name);
 static int resolveUpvalue(Compiler* compiler, Token* name);
 
+// Works out `a <operator> b` for two literals, the way the VM would. Returns false if it can't be done at compile time,
+// which includes mixing types the VM reports an error for: that stays a runtime error.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    switch (operatorType) {
+        case TOKEN_EQUAL_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+        case TOKEN_BANG_EQUAL:
+            *result = BOOL_VAL(!valuesEqual(a, b));
+            return true;
+        default:
+            break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        // Both strings sit in the constant pool, so they're safe from the collector while the result is built.
+        ObjString* string = newString(AS_STRING(a)->length + AS_STRING(b)->length);
+        memcpy(string->chars, AS_CSTRING(a), AS_STRING(a)->length);
+        memcpy(string->chars + AS_STRING(a)->length, AS_CSTRING(b), AS_STRING(b)->length);
+        *result = OBJ_VAL(internString(string));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(x >= y); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(x <= y); return true;
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        default:
+            return false;
+    }
+}
+
 static void binary(bool _) {
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
+
+    Value left, right, result;
+    bool leftConstant = constantAt(parser.depth, &left);
+    int leftOffset = parser.constantOffset;
+    int rightOffset = currentChunk()->count;
     parsePrecedence((Precedence) (rule->precedence + 1));
 
+    if (leftConstant && constantAt(parser.depth + 1, &right) && parser.constantOffset == rightOffset &&
+        foldBinary(operatorType, left, right, &result)) {
+        emitFolded(leftOffset, rightOffset, result);
+        return;
+    }
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitByte(OP_NOT_EQUAL);
             break;
         case TOKEN_EQUAL_EQUAL:
             emitByte(OP_EQUAL);
@@ -299,13 +545,13 @@ static void binary(bool _) {
             emitByte(OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitByte(OP_GREATER_EQUAL);
             break;
         case TOKEN_LESS:
             emitByte(OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitByte(OP_LESS_EQUAL);
             break;
         case TOKEN_PLUS:
             emitByte(OP_ADD);
@@ -346,21 +592,27 @@ static void call(bool _) {
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, name);
+        emitInlineCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
             uint8_t argCount = argumentList();
-            emitBytes(OP_INVOKE, name);
+            emitIndexed(OP_INVOKE, name);
             emitByte(argCount);
+            emitInlineCache();
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        parser.getOffset = currentChunk()->count;
+        parser.getDepth = parser.depth;
+        emitIndexed(OP_GET_PROPERTY, name);
+        emitInlineCache();
     }
 }
 
 static void literal(bool _) {
+    markConstant(currentChunk()->count);
     switch (parser.previous.type) {
         case TOKEN_FALSE:
             emitByte(OP_FALSE);
@@ -377,16 +629,46 @@ static void literal(bool _) {
 }
 
 static void grouping(bool _) {
+    int depth = parser.depth;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    liftConstant(depth);
+
+    // A parenthesized property that's called straight away, like `(object.method)(argument)`, would otherwise bind the
+    // method into a new ObjBoundMethod just to call it once. If the get is the last thing the expression inside the
+    // parentheses did at its top level (so not the right-hand side of an `or`, say), turn it into the matching method
+    // get and do the call here. Those leave the method and its receiver on the stack for OP_CALL_METHOD instead.
+    if (!check(TOKEN_LEFT_PAREN) || parser.getDepth != depth + 1) return;
+
+    uint8_t* code = currentChunk()->code;
+    int offset = parser.getOffset;
+    if (offset < 0) return;
+
+    // A wide get is two bytes longer: the prefix, and the second byte of the name operand.
+    bool wide = code[offset] == OP_WIDE;
+    int instruction = wide ? offset + 1 : offset;
+    int length = currentChunk()->count - offset - (wide ? 2 : 0);
+    if (length == 4 && code[instruction] == OP_GET_PROPERTY) {
+        code[instruction] = OP_GET_METHOD;
+    } else if (length == 2 && code[instruction] == OP_GET_SUPER) {
+        code[instruction] = OP_GET_SUPER_METHOD;
+    } else {
+        return;
+    }
+
+    advance();
+    uint8_t argCount = argumentList();
+    emitBytes(OP_CALL_METHOD, argCount);
 }
 
 static void number(bool _) {
     double value = strtod(parser.previous.start, NULL);
+    markConstant(currentChunk()->count);
     emitConstant(NUMBER_VAL(value));
 }
 
 static void string(bool _) {
+    markConstant(currentChunk()->count);
     emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
@@ -400,16 +682,22 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    // Global slots always take a 16-bit operand, locals and upvalues only past the first 256.
+    if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+        emitGlobal(op, (uint16_t)arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(op, arg);
     }
 }
 
@@ -433,17 +721,19 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitIndexed(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        parser.getOffset = currentChunk()->count;
+        parser.getDepth = parser.depth;
+        emitIndexed(OP_GET_SUPER, name);
     }
 }
 
@@ -458,10 +748,23 @@ static void this_(bool _) {
 
 static void unary(bool _) {
     TokenType operatorType = parser.previous.type;
+    int operandOffset = currentChunk()->count;
 
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
 
+    // Fold it if it's a literal: `!` works on anything, `-` only on numbers.
+    Value operand;
+    if (constantAt(parser.depth + 1, &operand) && parser.constantOffset == operandOffset) {
+        if (operatorType == TOKEN_BANG) {
+            emitFolded(operandOffset, -1, BOOL_VAL(isFalsey(operand)));
+            return;
+        } else if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            emitFolded(operandOffset, -1, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_MINUS:
@@ -475,7 +778,30 @@ static void unary(bool _) {
     }
 }
 
+// With a literal on the left, `and` and `or` know which way they go. Either the left operand is the result and the right
+// one is compiled only to check it, or the right operand is the result and the left one is dropped.
+static bool foldLogical(bool shortCircuitsOn, Precedence precedence) {
+    Value left;
+    if (!constantAt(parser.depth, &left)) return false;
+
+    int leftOffset = parser.constantOffset;
+    if (isFalsey(left) == shortCircuitsOn) {
+        CodeMark end = markCode();
+        parsePrecedence(precedence);
+        discardSince(end);
+        markConstant(leftOffset);
+    } else {
+        dropConstant(leftOffset);
+        discardCode(leftOffset);
+        parsePrecedence(precedence);
+        liftConstant(parser.depth);
+    }
+    return true;
+}
+
 static void and_(bool _) {
+    if (foldLogical(true, PREC_AND)) return;
+
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
@@ -485,6 +811,8 @@ static void and_(bool _) {
 }
 
 static void or_(bool _) {
+    if (foldLogical(false, PREC_OR)) return;
+
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
 
@@ -547,6 +875,8 @@ static void parsePrecedence(Precedence precedence) {
         return;
     }
 
+    parser.depth++;
+
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
@@ -559,12 +889,25 @@ static void parsePrecedence(Precedence precedence) {
     if (canAssign && match(TOKEN_EQUAL)) {
         error("Invalid assignment target.");
     }
+    parser.depth--;
 }
 
-static uint8_t identifierConstant(Token *name) {
+static int identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// Globals are resolved to their slot in vm.globalValues here, at compile time, so the VM never hashes a global's name.
+// A name that isn't declared yet still gets a slot. It stays undefined until its declaration runs, which is what lets a
+// function refer to a global declared further down the script.
+static uint16_t globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
@@ -585,7 +928,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -595,14 +938,15 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
-    compiler->upvalues[upvalueCount].isLocal = isLocal;
-    compiler->upvalues[upvalueCount].index = index;
-    return compiler->function->upvalueCount++;
+    Upvalue* upvalue = pushUpvalue(compiler);
+    upvalue->isLocal = isLocal;
+    upvalue->index = index;
+    return upvalueCount;
 }
 
 static int resolveUpvalue(Compiler* compiler, Token* name) {
@@ -611,24 +955,24 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint16_t)local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
 }
 
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -674,13 +1018,13 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -689,13 +1033,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static ParseRule *getRule(TokenType type) {
@@ -726,7 +1070,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -735,17 +1079,32 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = makeConstant(OBJ_VAL(function));
+
+    // If anything doesn't fit in a byte, the wide form widens the function's constant and every upvalue index.
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+
+    if (wide) {
+        emitBytes(OP_WIDE, OP_CLOSURE);
+        emitBytes((constant >> 8) & 0xff, constant & 0xff);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (wide) emitByte((compiler.upvalues[i].index >> 8) & 0xff);
+        emitByte(compiler.upvalues[i].index & 0xff);
     }
+    free(compiler.upvalues);
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -753,17 +1112,18 @@ static void method() {
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitIndexed(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
+    uint16_t global = current->scopeDepth > 0 ? 0 : globalVariable(&className);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitIndexed(OP_CLASS, nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -807,20 +1167,20 @@ static void delStatement() {
     variable(false);
     consume(TOKEN_DOT, "Expect '.' man...");
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
-    emitBytes(OP_DEL_PROPERTY, name);
+    int name = identifierConstant(&parser.previous);
+    emitIndexed(OP_DEL_PROPERTY, name);
     consume(TOKEN_SEMICOLON, "You need a semicolon");
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -838,6 +1198,21 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+// Compiles a statement that can never run, so its errors are still reported, then takes its code back.
+static void deadStatement() {
+    CodeMark start = markCode();
+    statement();
+    discardSince(start);
+}
+
+// If the condition just compiled is a literal, takes its code back and stores its value.
+static bool constantCondition(int offset, Value* value) {
+    if (!constantAt(parser.depth + 1, value)) return false;
+    dropConstant(offset);
+    discardCode(offset);
+    return true;
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
@@ -850,14 +1225,23 @@ static void forStatement() {
     }
 
     int loopStart = currentChunk()->count;
+    CodeMark conditionStart = markCode();
     int exitJump = -1;
+    bool dead = false;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        // A constant condition either never exits, like an empty one, or never enters, and then everything after the
+        // initializer goes.
+        Value condition;
+        if (constantCondition(loopStart, &condition)) {
+            dead = isFalsey(condition);
+        } else {
+            // Jump out of the loop if the condition is false.
+            exitJump = emitJump(OP_JUMP_IF_FALSE);
+            emitByte(OP_POP); // Condition.
+        }
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
@@ -880,14 +1264,29 @@ static void forStatement() {
         emitByte(OP_POP); // Condition.
     }
 
+    if (dead) discardSince(conditionStart);
     endScope();
 }
 
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
+    // With a constant condition only one branch can run, and no jumps are needed. The other is compiled and dropped.
+    Value condition;
+    if (constantCondition(conditionStart, &condition)) {
+        if (isFalsey(condition)) {
+            deadStatement();
+            if (match(TOKEN_ELSE)) statement();
+        } else {
+            statement();
+            if (match(TOKEN_ELSE)) deadStatement();
+        }
+        return;
+    }
+
     // Jump from inside the "then" branch. If the condition is falsey, we want to jump over the then
     // branch over to the "else" branch. That's what this instruction is doing.
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
@@ -917,6 +1316,18 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    // `while (false)` compiles to nothing, and `while (true)` needs no test.
+    Value condition;
+    if (constantCondition(loopStart, &condition)) {
+        if (isFalsey(condition)) {
+            deadStatement();
+        } else {
+            statement();
+            emitLoop(loopStart);
+        }
+        return;
+    }
+
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     statement();
@@ -1016,6 +1427,11 @@ ObjFunction* compile(const char* source) {
 
     parser.hadError = false;
     parser.panicMode = false;
+    parser.depth = 0;
+    parser.getOffset = -1;
+    parser.getDepth = -1;
+    parser.constantOffset = -1;
+    parser.constantDepth = -1;
 
     advance();
 
@@ -1030,6 +1446,9 @@ ObjFunction* compile(const char* source) {
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
+        // The compiler fills in the functions it's building (constants, names, caches) without write barriers, so
+        // they stay remembered for as long as they're being compiled.
+        WRITE_BARRIER(compiler->function);
         markObject((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
@@ -3,6 +3,7 @@
 
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name, const uint8_t* ip) {
     printf("== code %s ==\n", name);
@@ -26,10 +27,18 @@ static int simpleInstruction(const char* name, int offset) {
     return offset + 1;
 }
 
-static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset + 1];
+// Reads an instruction's first operand, which OP_WIDE makes two bytes long, and moves `offset` past it.
+static int indexOperand(Chunk* chunk, int* offset, bool wide) {
+    int index = chunk->code[(*offset)++];
+    if (wide) index = (index << 8) | chunk->code[(*offset)++];
+    return index;
+}
+
+static int byteInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    offset++;
+    int slot = indexOperand(chunk, &offset, wide);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return offset;
 }
 
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
@@ -39,32 +48,92 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+static int constantInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    offset++;
+    int constant = indexOperand(chunk, &offset, wide);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+// A register instruction: a result slot, then the left operand's slot and the right operand, a slot or a constant.
+static int registerInstruction(const char* name, bool constant, Chunk* chunk, int offset) {
+    uint8_t result = chunk->code[offset + 1];
+    uint8_t left = chunk->code[offset + 2];
+    uint8_t right = chunk->code[offset + 3];
+    if (constant) {
+        printf("%-16s %4d %4d %4d '", name, result, left, right);
+        printValue(chunk->constants.values[right]);
+        printf("'\n");
+    } else {
+        printf("%-16s %4d %4d %4d\n", name, result, left, right);
+    }
+    return offset + 4;
+}
+
+static int registerJumpInstruction(const char* name, bool constant, Chunk* chunk, int offset) {
+    uint8_t left = chunk->code[offset + 1];
+    uint8_t right = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d %4d", name, left, right);
+    if (constant) {
+        printf(" '");
+        printValue(chunk->constants.values[right]);
+        printf("'");
+    }
+    printf(" -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    offset++;
+    int constant = indexOperand(chunk, &offset, wide);
+    uint8_t argCount = chunk->code[offset];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 3;
+    return offset + 1;
 }
 
-static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint32_t constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+static int propertyInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    offset++;
+    int constant = indexOperand(chunk, &offset, wide);
+    uint16_t cache = (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 2;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    offset++;
+    int constant = indexOperand(chunk, &offset, wide);
+    uint8_t argCount = chunk->code[offset];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 3;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
     printf("'\n");
-    return offset + 4;
+    return offset + 3;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset, const uint8_t* ip) {
+// `wide` is set for the instruction after an OP_WIDE, which prints on its own line first.
+static int disassemble(Chunk* chunk, int offset, const uint8_t* ip, bool wide) {
     bool isExecutingInstruction = ip != NULL && ip == &chunk->code[offset];
     printf("%s", isExecutingInstruction ? "=> " : "   ");
 
@@ -85,41 +154,51 @@ int disassembleInstruction(Chunk* chunk, int offset, const uint8_t* ip) {
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return byteInstruction("OP_CALL", chunk, offset, wide);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset, wide);
         case OP_CLOSURE: {
             offset++;
-            uint8_t constant = chunk->code[offset++];
+            int constant = indexOperand(chunk, &offset, wide);
             printf("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
 
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
+                int start = offset;
                 int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                int index = indexOperand(chunk, &offset, wide);
+                printf("%04d      |                     %s %d\n", start, isLocal ? "local" : "upvalue", index);
             }
 
             return offset;
         }
+        case OP_WIDE:
+            printf("OP_WIDE\n");
+            return disassemble(chunk, offset + 1, ip, true);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction("OP_CLASS", chunk, offset, wide);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction("OP_METHOD", chunk, offset, wide);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset, wide);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset, wide);
         case OP_DEL_PROPERTY:
-            return constantInstruction("OP_DELETE_PROPERTY", chunk, offset);
+            return constantInstruction("OP_DELETE_PROPERTY", chunk, offset, wide);
+        case OP_GET_METHOD:
+            return propertyInstruction("OP_GET_METHOD", chunk, offset, wide);
+        case OP_GET_SUPER_METHOD:
+            return constantInstruction("OP_GET_SUPER_METHOD", chunk, offset, wide);
+        case OP_CALL_METHOD:
+            return byteInstruction("OP_CALL_METHOD", chunk, offset, wide);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_POP:
@@ -137,9 +216,7 @@ int disassembleInstruction(Chunk* chunk, int offset, const uint8_t* ip) {
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
-        case OP_CONSTANT_LONG:
-            return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+            return constantInstruction("OP_CONSTANT", chunk, offset, wide);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -147,31 +224,115 @@ int disassembleInstruction(Chunk* chunk, int offset, const uint8_t* ip) {
         case OP_FALSE:
             return simpleInstruction("OP_FALSE", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset, wide);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset, wide);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction("OP_GET_LOCAL", chunk, offset, wide);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction("OP_SET_LOCAL", chunk, offset, wide);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantInstruction("OP_GET_SUPER", chunk, offset, wide);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, wide);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_ADD_LOCALS:
+            return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction("OP_ADD_CONSTANT", chunk, offset, wide);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset, wide);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_MOVE:
+            return twoByteInstruction("OP_MOVE", chunk, offset);
+        case OP_LOAD_CONSTANT: {
+            uint8_t local = chunk->code[offset + 1];
+            uint8_t constant = chunk->code[offset + 2];
+            printf("%-16s %4d %4d '", "OP_LOAD_CONSTANT", local, constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 3;
+        }
+        case OP_ADD_RR:
+            return registerInstruction("OP_ADD_RR", false, chunk, offset);
+        case OP_ADD_RK:
+            return registerInstruction("OP_ADD_RK", true, chunk, offset);
+        case OP_SUBTRACT_RR:
+            return registerInstruction("OP_SUBTRACT_RR", false, chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerInstruction("OP_SUBTRACT_RK", true, chunk, offset);
+        case OP_MULTIPLY_RR:
+            return registerInstruction("OP_MULTIPLY_RR", false, chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerInstruction("OP_MULTIPLY_RK", true, chunk, offset);
+        case OP_DIVIDE_RR:
+            return registerInstruction("OP_DIVIDE_RR", false, chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerInstruction("OP_DIVIDE_RK", true, chunk, offset);
+        case OP_ADD_RR_SET:
+            return registerInstruction("OP_ADD_RR_SET", false, chunk, offset);
+        case OP_ADD_RK_SET:
+            return registerInstruction("OP_ADD_RK_SET", true, chunk, offset);
+        case OP_SUBTRACT_RR_SET:
+            return registerInstruction("OP_SUBTRACT_RR_SET", false, chunk, offset);
+        case OP_SUBTRACT_RK_SET:
+            return registerInstruction("OP_SUBTRACT_RK_SET", true, chunk, offset);
+        case OP_MULTIPLY_RR_SET:
+            return registerInstruction("OP_MULTIPLY_RR_SET", false, chunk, offset);
+        case OP_MULTIPLY_RK_SET:
+            return registerInstruction("OP_MULTIPLY_RK_SET", true, chunk, offset);
+        case OP_DIVIDE_RR_SET:
+            return registerInstruction("OP_DIVIDE_RR_SET", false, chunk, offset);
+        case OP_DIVIDE_RK_SET:
+            return registerInstruction("OP_DIVIDE_RK_SET", true, chunk, offset);
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_EQUAL_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_EQUAL_RK_JUMP_IF_FALSE", true, chunk, offset);
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_NOT_EQUAL_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_NOT_EQUAL_RK_JUMP_IF_FALSE", true, chunk, offset);
+        case OP_LESS_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_LESS_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_LESS_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_LESS_RK_JUMP_IF_FALSE", true, chunk, offset);
+        case OP_LESS_EQUAL_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_LESS_EQUAL_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_LESS_EQUAL_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_LESS_EQUAL_RK_JUMP_IF_FALSE", true, chunk, offset);
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_GREATER_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_GREATER_RK_JUMP_IF_FALSE", true, chunk, offset);
+        case OP_GREATER_EQUAL_RR_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_GREATER_EQUAL_RR_JUMP_IF_FALSE", false, chunk, offset);
+        case OP_GREATER_EQUAL_RK_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_GREATER_EQUAL_RK_JUMP_IF_FALSE", true, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+int disassembleInstruction(Chunk* chunk, int offset, const uint8_t* ip) {
+    return disassemble(chunk, offset, ip, false);
+}
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "memory.h"
+#include "vm.h"
+
+// An image holds, with every integer in the byte order of the machine that wrote it:
+//
+//   header    "LOXC", IMAGE_VERSION, IMAGE_CODEGEN, then the length and hash of the source it was compiled from.
+//   globals   The names of every global slot, in slot order. Global instructions refer to slots, not names, so loading
+//             the image has to hand out the same slots again.
+//   script    The top-level function, see writeFunction(). Nested functions are among its constants.
+//
+// A string is its length followed by its characters. Closures' upvalue descriptors are operands of OP_CLOSURE, so they
+// come along with the code.
+//
+// A loaded image stays mapped into memory, and each function's code and line table are used right where they are in
+// the mapping rather than copied out. Every process running the same script shares those pages through the page
+// cache. Only the constants are read out, since strings and functions have to be objects on the heap.
+
+#define IMAGE_MAGIC "LOXC"
+// Bump this whenever the layout or the instruction set changes, so older images get recompiled instead of misread.
+#define IMAGE_VERSION 5
+// Which code generator wrote the image. A REGISTER_BYTECODE build only loads images of register code and any other
+// build only loads images of stack code, so the two can be compared on the same scripts without running each other's.
+#ifdef REGISTER_BYTECODE
+#define IMAGE_CODEGEN 1
+#else
+#define IMAGE_CODEGEN 0
+#endif
+#define NO_NAME UINT32_MAX
+// Every function being read sits on the VM's stack, which only grows for calls. Anything nested deeper than this is
+// compiled instead.
+#define MAX_NESTING 64
+#define LINES_ALIGNMENT sizeof(int)
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+typedef struct {
+    uint64_t length;
+    uint64_t hash;
+} SourceStamp;
+
+// The image is only used if the source is byte for byte the one it was compiled from. Hashing the contents instead of
+// comparing modification times means a copied or checked-out file with an older timestamp can't pick up a stale image.
+static SourceStamp stampSource(const char* source) {
+    SourceStamp stamp;
+    stamp.length = strlen(source);
+    stamp.hash = UINT64_C(14695981039346656037);
+    for (uint64_t i = 0; i < stamp.length; i++) {
+        stamp.hash ^= (uint8_t)source[i];
+        stamp.hash *= UINT64_C(1099511628211);
+    }
+    return stamp;
+}
+
+static void writeU32(FILE* file, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+static void writeString(FILE* file, ObjString* string) {
+    writeU32(file, (uint32_t)string->length);
+    fwrite(string->chars, 1, string->length, file);
+}
+
+static bool writeFunction(FILE* file, ObjFunction* function) {
+    writeU32(file, (uint32_t)function->arity);
+    writeU32(file, (uint32_t)function->upvalueCount);
+    writeU32(file, (uint32_t)function->maxSlots);
+    if (function->name == NULL) {
+        writeU32(file, NO_NAME);
+    } else {
+        writeString(file, function->name);
+    }
+
+    Chunk* chunk = &function->chunk;
+    writeU32(file, (uint32_t)chunk->count);
+    fwrite(chunk->code, 1, chunk->count, file);
+
+    // The line table is used in place, so it's written exactly as it is in memory, aligned the same way.
+    writeU32(file, (uint32_t)chunk->lineCount);
+    for (long offset = ftell(file); offset % LINES_ALIGNMENT != 0; offset++) fputc(0, file);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, file);
+    writeU32(file, (uint32_t)chunk->cacheCount);
+
+    writeU32(file, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NIL(value)) {
+            fputc(CONSTANT_NIL, file);
+        } else if (IS_BOOL(value)) {
+            fputc(AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE, file);
+        } else if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            fputc(CONSTANT_NUMBER, file);
+            fwrite(&number, sizeof(number), 1, file);
+        } else if (IS_STRING(value)) {
+            fputc(CONSTANT_STRING, file);
+            writeString(file, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            fputc(CONSTANT_FUNCTION, file);
+            if (!writeFunction(file, AS_FUNCTION(value))) return false;
+        } else {
+            return false; // The compiler never makes any other kind of constant.
+        }
+    }
+    return true;
+}
+
+bool writeImage(const char* path, ObjFunction* function, const char* source) {
+    // Write to a file of our own and rename it into place, so a script started while another run of it is still
+    // writing the image never sees half of one.
+    size_t tempSize = strlen(path) + 32;
+    char* tempPath = (char*)malloc(tempSize);
+    if (tempPath == NULL) return false;
+    snprintf(tempPath, tempSize, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE* file = fopen(tempPath, "wb");
+    if (file == NULL) {
+        free(tempPath);
+        return false;
+    }
+
+    SourceStamp stamp = stampSource(source);
+    fwrite(IMAGE_MAGIC, 1, 4, file);
+    writeU32(file, IMAGE_VERSION);
+    writeU32(file, IMAGE_CODEGEN);
+    fwrite(&stamp, sizeof(stamp), 1, file);
+
+    writeU32(file, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeString(file, AS_STRING(vm.globalNames.values[i]));
+    }
+
+    bool written = writeFunction(file, function);
+    written = !ferror(file) && written;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        written = false;
+    }
+
+    free(tempPath);
+    return written;
+}
+
+// Reads out of the whole image in memory. Running off the end, or finding anything that doesn't look like what
+// writeImage() produces, clears `ok`, and the script is compiled from source instead.
+typedef struct {
+    const uint8_t* start;
+    const uint8_t* current;
+    const uint8_t* end;
+    int nesting;
+    bool ok;
+} Reader;
+
+static bool readBytes(Reader* reader, void* bytes, size_t size) {
+    if (!reader->ok || (size_t)(reader->end - reader->current) < size) {
+        reader->ok = false;
+        return false;
+    }
+
+    memcpy(bytes, reader->current, size);
+    reader->current += size;
+    return true;
+}
+
+static uint32_t readU32(Reader* reader) {
+    uint32_t value = 0;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+// Checks that `count` items of `size` bytes each are still to come, before anything is allocated for them.
+static bool hasRoom(Reader* reader, uint32_t count, size_t size) {
+    if (reader->ok && (uint64_t)count * size <= (uint64_t)(reader->end - reader->current)) return true;
+    reader->ok = false;
+    return false;
+}
+
+static ObjString* readString(Reader* reader, uint32_t length) {
+    if (length > INT32_MAX || !hasRoom(reader, length, 1)) return NULL;
+
+    ObjString* string = copyString((const char*)reader->current, (int)length);
+    reader->current += length;
+    return string;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+    if (++reader->nesting > MAX_NESTING) reader->ok = false;
+    if (!reader->ok) return NULL;
+
+    ObjFunction* function = newFunction();
+    // Keep the function reachable while the objects it refers to are allocated.
+    push(OBJ_VAL(function));
+
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    function->maxSlots = (int)readU32(reader);
+    uint32_t nameLength = readU32(reader);
+    if (reader->ok && nameLength != NO_NAME) {
+        function->name = readString(reader, nameLength);
+        WRITE_BARRIER(function);
+    }
+
+    Chunk* chunk = &function->chunk;
+    // The code and line table stay in the mapping. A capacity of zero tells freeChunk() they aren't on the heap.
+    uint32_t count = readU32(reader);
+    if (count <= INT32_MAX && hasRoom(reader, count, 1)) {
+        chunk->code = (uint8_t*)reader->current;
+        chunk->count = (int)count;
+        reader->current += count;
+    }
+
+    uint32_t lineCount = readU32(reader);
+    size_t padding = (LINES_ALIGNMENT - (reader->current - reader->start) % LINES_ALIGNMENT) % LINES_ALIGNMENT;
+    if (hasRoom(reader, (uint32_t)padding, 1)) reader->current += padding;
+    if (lineCount <= INT32_MAX && hasRoom(reader, lineCount, sizeof(LineStart))) {
+        chunk->lines = (LineStart*)reader->current;
+        chunk->lineCount = (int)lineCount;
+        reader->current += lineCount * sizeof(LineStart);
+    }
+
+    uint32_t cacheCount = readU32(reader);
+    if (reader->ok && cacheCount > UINT16_MAX + 1) reader->ok = false;
+    for (uint32_t i = 0; reader->ok && i < cacheCount; i++) {
+        addInlineCache(chunk);
+    }
+
+    uint32_t constantCount = readU32(reader);
+    if (!hasRoom(reader, constantCount, 1)) constantCount = 0;
+    for (uint32_t i = 0; reader->ok && i < constantCount; i++) {
+        uint8_t tag = 0;
+        readBytes(reader, &tag, 1);
+
+        Value value = NIL_VAL;
+        switch (tag) {
+            case CONSTANT_NIL:
+                break;
+            case CONSTANT_FALSE:
+                value = BOOL_VAL(false);
+                break;
+            case CONSTANT_TRUE:
+                value = BOOL_VAL(true);
+                break;
+            case CONSTANT_NUMBER: {
+                double number = 0;
+                readBytes(reader, &number, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString* string = readString(reader, readU32(reader));
+                if (string != NULL) value = OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                if (nested != NULL) value = OBJ_VAL(nested);
+                break;
+            }
+            default:
+                reader->ok = false;
+                break;
+        }
+
+        if (!reader->ok) break;
+        addConstant(chunk, value);
+        WRITE_BARRIER(function);
+    }
+
+    pop();
+    reader->nesting--;
+    return reader->ok ? function : NULL;
+}
+
+// Every image that's been loaded, kept mapped until freeVM() since the functions read from it run their code there.
+// writeImage() replaces an image by renaming a new file over it, which leaves a mapping of the old one intact.
+typedef struct {
+    void* start;
+    size_t size;
+} Mapping;
+
+static Mapping* mappings = NULL;
+static int mappingCount = 0;
+
+static uint8_t* mapFile(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat status;
+    void* start = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        start = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // The mapping holds its own reference to the file.
+    close(fd);
+    if (start == MAP_FAILED) return NULL;
+
+    *size = (size_t)status.st_size;
+    return (uint8_t*)start;
+}
+
+void unmapImages() {
+    for (int i = 0; i < mappingCount; i++) {
+        munmap(mappings[i].start, mappings[i].size);
+    }
+    free(mappings);
+    mappings = NULL;
+    mappingCount = 0;
+}
+
+ObjFunction* readImage(const char* path, const char* source) {
+    size_t size;
+    uint8_t* image = mapFile(path, &size);
+    if (image == NULL) return NULL;
+
+    Reader reader;
+    reader.start = image;
+    reader.current = image;
+    reader.end = image + size;
+    reader.nesting = 0;
+    reader.ok = true;
+
+    char magic[4];
+    SourceStamp stamp;
+    SourceStamp expected = stampSource(source);
+    readBytes(&reader, magic, sizeof(magic));
+    uint32_t version = readU32(&reader);
+    uint32_t codegen = readU32(&reader);
+    readBytes(&reader, &stamp, sizeof(stamp));
+    if (!reader.ok || memcmp(magic, IMAGE_MAGIC, 4) != 0 || version != IMAGE_VERSION || codegen != IMAGE_CODEGEN ||
+        stamp.length != expected.length || stamp.hash != expected.hash) {
+        munmap(image, size);
+        return NULL;
+    }
+
+    // The names go in in the order they were first compiled, so they get the slots the code expects. Anything the
+    // VM defined itself, like the natives, is already there and has to come out where it was when the image was made.
+    uint32_t globalCount = readU32(&reader);
+    for (uint32_t i = 0; reader.ok && i < globalCount; i++) {
+        ObjString* name = readString(&reader, readU32(&reader));
+        if (name == NULL || globalSlot(name) != (int)i) reader.ok = false;
+    }
+
+    ObjFunction* function = reader.ok ? readFunction(&reader) : NULL;
+    if (function == NULL) {
+        // Any functions read before the image turned out to be bad are garbage, and the collector never looks at their
+        // code.
+        munmap(image, size);
+        return NULL;
+    }
+
+    mappings = (Mapping*)realloc(mappings, sizeof(Mapping) * (mappingCount + 1));
+    if (mappings == NULL) exit(1);
+    mappings[mappingCount].start = image;
+    mappings[mappingCount].size = size;
+    mappingCount++;
+    return function;
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "object.h"
+
+// An image is a compiled script saved to disk, so the next run of the same source can load its bytecode instead of
+// compiling it again. runFile() keeps one next to each script, as a .loxc file.
+bool writeImage(const char* path, ObjFunction* function, const char* source);
+// Returns NULL if there's no image at `path`, or it wasn't compiled from `source` by this version of clox with the same
+// code generator (see IMAGE_CODEGEN).
+ObjFunction* readImage(const char* path, const char* source);
+void unmapImages();
+
+#endif //CLOX_IMAGE_H
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
@@ -48,9 +49,29 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+// The compiled bytecode for script.lox is kept in script.loxc. A script without the .lox extension gets .loxc added.
+static char* imagePath(const char* path) {
+    size_t length = strlen(path);
+    char* image = (char*)malloc(length + 6);
+    if (image == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    strcpy(image, path);
+    if (length >= 4 && strcmp(path + length - 4, ".lox") == 0) {
+        strcat(image, "c");
+    } else {
+        strcat(image, ".loxc");
+    }
+    return image;
+}
+
 static void runFile(const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    char* image = imagePath(path);
+    InterpretResult result = interpretCached(source, image);
+    free(image);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
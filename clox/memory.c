@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "object.h"
@@ -10,7 +11,99 @@
 #include "debug.h"
 #endif
 
+#ifdef DEBUG_PRINT_STATS
+#include <time.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
+// How many bytes the program may allocate between two minor collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+// A major collection runs in steps, one every GC_STEP_SIZE bytes allocated. Each step blackens or sweeps at most
+// GC_WORK_BUDGET objects, which is what bounds the pause. Build with -DGC_WORK_BUDGET=n to trade pause length for
+// how long a collection takes to finish.
+#define GC_STEP_SIZE (64 * 1024)
+#ifndef GC_WORK_BUDGET
+#define GC_WORK_BUDGET 2000
+#endif
+
+#ifdef POOL_ALLOCATOR
+// Most allocations are small and fixed-size: objects, short strings, closures' upvalue arrays, small tables. Instead
+// of a malloc each, blocks up to POOL_MAX_SIZE bytes come from segregated free lists, one per size class of
+// POOL_GRANULE bytes. A class with an empty free list carves new blocks off the current slab. Freed blocks go back on
+// their class's list and are never returned to malloc, until freeObjects() releases every slab at once.
+//
+// There's no block header: every caller of reallocate() already passes the size it allocated, which is enough to find
+// the size class again.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+// Slabs are chained through their first POOL_GRANULE bytes, so blocks after it stay 16-byte aligned.
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+static PoolBlock* freeLists[POOL_CLASSES];
+static Slab* slabs = NULL;
+static char* slabTop = NULL;
+static char* slabEnd = NULL;
+
+static bool isPooled(size_t size) {
+    return size > 0 && size <= POOL_MAX_SIZE;
+}
+
+static int sizeClass(size_t size) {
+    return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+}
+
+static void* poolAllocate(size_t size) {
+    int index = sizeClass(size);
+    PoolBlock* block = freeLists[index];
+    if (block != NULL) {
+        freeLists[index] = block->next;
+        return block;
+    }
+
+    size_t blockSize = (size_t)(index + 1) * POOL_GRANULE;
+    if (slabTop == NULL || (size_t)(slabEnd - slabTop) < blockSize) {
+        Slab* slab = (Slab*)malloc(POOL_SLAB_SIZE);
+        if (slab == NULL) exit(1);
+        slab->next = slabs;
+        slabs = slab;
+        slabTop = (char*)slab + POOL_GRANULE;
+        slabEnd = (char*)slab + POOL_SLAB_SIZE;
+    }
+
+    void* result = slabTop;
+    slabTop += blockSize;
+    return result;
+}
+
+static void poolFree(void* pointer, size_t size) {
+    int index = sizeClass(size);
+    PoolBlock* block = (PoolBlock*)pointer;
+    block->next = freeLists[index];
+    freeLists[index] = block;
+}
+
+static void freePools() {
+    while (slabs != NULL) {
+        Slab* next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    slabTop = NULL;
+    slabEnd = NULL;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        freeLists[i] = NULL;
+    }
+}
+#endif
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
@@ -18,11 +111,38 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
+
+        // Only check when growing: a sweep frees objects through here and mustn't start another collection.
+        if (vm.bytesAllocated > vm.nextGC) {
+            collectGarbage();
+        }
     }
 
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+#ifdef POOL_ALLOCATOR
+    if (isPooled(oldSize) || isPooled(newSize)) {
+        if (pointer != NULL && isPooled(newSize) && isPooled(oldSize) && sizeClass(oldSize) == sizeClass(newSize)) {
+            return pointer;
+        }
+
+        void* result = NULL;
+        if (isPooled(newSize)) {
+            result = poolAllocate(newSize);
+        } else if (newSize > 0) {
+            result = malloc(newSize);
+            if (result == NULL) exit(1);
+        }
+
+        if (pointer != NULL) {
+            if (result != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+            if (isPooled(oldSize)) {
+                poolFree(pointer, oldSize);
+            } else {
+                free(pointer);
+            }
+        }
+        return result;
     }
+#endif
 
     if (newSize == 0) {
         free(pointer);
@@ -37,25 +157,55 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+static void pushGray(Obj* object) {
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack,sizeof(Obj*) * vm.grayCapacity);
+
+        if (vm.grayStack == NULL) exit(1);
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
 void markObject(Obj* object) {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (IS_MARKED(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    object->mark = vm.markEpoch;
+    pushGray(object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack,sizeof(Obj*) * vm.grayCapacity);
+void rememberObject(Obj* object) {
+    object->isRemembered = true;
 
-        if (vm.grayStack == NULL) exit(1);
+    // While marking, a marked object that's written to might already be black. Graying it again makes the collector
+    // trace it once more, so whatever was just stored in it can't be missed.
+    if (vm.gcPhase == GC_MARKING) {
+        pushGray(object);
+        return;
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
 }
 
 void markValue(Value value) {
@@ -94,18 +244,51 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // Keep cached shapes and methods alive, otherwise a new shape allocated at the same address could hit a
+            // stale cache entry.
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+                    markObject((Obj*)cache->ways[j].shape);
+                    markObject((Obj*)cache->ways[j].transition);
+                    markObject((Obj*)cache->ways[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            if (instance->shape != NULL) {
+                markObject((Obj*)instance->shape);
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    markValue(instance->fields[i]);
+                }
+            }
+            markTable(&instance->dictionary);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markObject((Obj*)klass->superclass);
+            markObject((Obj*)klass->rootShape);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
             break;
         }
         case OBJ_UPVALUE:
@@ -131,8 +314,9 @@ static void freeObject(Obj* object) {
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            // vm.strings doesn't keep its strings alive, so drop the entry for this one.
+            tableDelete(&vm.strings, string);
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
             break;
         }
         case OBJ_FUNCTION: {
@@ -152,10 +336,21 @@ static void freeObject(Obj* object) {
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            freeTable(&instance->dictionary);
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
@@ -167,7 +362,8 @@ static void markRoots() {
         markValue(*slot);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
 
     for (int i = 0; i < vm.frameCount; i++) {
         markObject((Obj*)vm.frames[i].closure);
@@ -184,44 +380,171 @@ static void markRoots() {
 static void traceReferences() {
     while (vm.grayCount > 0) {
         Obj* object = vm.grayStack[--vm.grayCount];
+        object->isRemembered = false;
         blackenObject(object);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
+// Blackens at most `budget` gray objects. Returns true once there's nothing left to trace.
+static bool traceSome(int budget) {
+    while (vm.grayCount > 0 && budget-- > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    return vm.grayCount == 0;
+}
+
+#ifdef GENERATIONAL_GC
+// Frees every unmarked young object and promotes the rest to the old list, which leaves the young list empty.
+static void sweepYoung() {
     Obj* object = vm.objects;
     while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+        Obj* next = object->next;
+        if (IS_MARKED(object)) {
+            object->next = vm.oldObjects;
+            vm.oldObjects = object;
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+            freeObject(object);
+        }
+        object = next;
+    }
+    vm.objects = NULL;
+}
+#endif
 
-            freeObject(unreached);
+// Sweeps at most `budget` objects: first the old list, then the young objects that were detached from vm.objects when
+// marking finished. The unmarked ones are freed, the marked young ones promoted. Returns true when the sweep is done.
+//
+// The program keeps running between steps. New objects go on a fresh vm.objects list, so the sweep never sees them,
+// and objects promoted by a minor collection are prepended to vm.oldObjects, where the cursor passes over them since
+// they're marked.
+static bool sweepSome(int budget) {
+    while (budget > 0 && *vm.sweepCursor != NULL) {
+        Obj* object = *vm.sweepCursor;
+        if (IS_MARKED(object)) {
+            vm.sweepCursor = &object->next;
+        } else {
+            *vm.sweepCursor = object->next;
+            freeObject(object);
+        }
+        budget--;
+    }
+
+    while (budget > 0 && vm.sweepingObjects != NULL) {
+        Obj* object = vm.sweepingObjects;
+        vm.sweepingObjects = object->next;
+        if (IS_MARKED(object)) {
+            object->next = vm.oldObjects;
+            vm.oldObjects = object;
+        } else {
+            freeObject(object);
         }
+        budget--;
     }
+
+    return *vm.sweepCursor == NULL && vm.sweepingObjects == NULL;
+}
+
+#ifdef GENERATIONAL_GC
+// Objects start out young, on vm.objects, with a mark of 0. Each major collection picks a new mark epoch (1 or 2), so
+// starting one unmarks every object at once. A minor collection marks with the current epoch too, and the objects it
+// promotes to vm.oldObjects simply keep that mark. So markObject() treats old objects as already traced and a minor
+// collection only walks and sweeps the young ones. The only other way a young object can be reachable is through an
+// old object written to since the last collection. Those are in vm.remembered thanks to WRITE_BARRIER, and get traced
+// explicitly.
+static void minorCollection() {
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
+    }
+    forgetRemembered();
+    traceReferences();
+    sweepYoung();
+}
+#endif
+
+// A major collection is incremental. It starts by switching epochs, which makes every object white, and graying the
+// roots. It then marks in steps while the program runs: the program can't hide a white object in an object the
+// collector has already blackened, since WRITE_BARRIER grays that object again. It can still stash one on the stack or
+// in a global, which are roots the barrier doesn't cover, so the final step traces the roots again before the sweep.
+// Objects allocated while marking start out white, and that last trace is what keeps the reachable ones alive.
+static void startMajorCollection() {
+    vm.markEpoch = vm.markEpoch == 1 ? 2 : 1;
+    forgetRemembered();
+    markRoots();
+    vm.gcPhase = GC_MARKING;
+}
+
+static void finishMarking() {
+    markRoots();
+    traceReferences();
+
+    vm.sweepingObjects = vm.objects;
+    vm.objects = NULL;
+    vm.sweepCursor = &vm.oldObjects;
+    vm.gcPhase = GC_SWEEPING;
 }
 
+// Called whenever vm.bytesAllocated passes vm.nextGC. Does the next piece of collection work, and decides how much the
+// program can allocate before the one after.
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
     size_t before = vm.bytesAllocated;
     printf("-- gc begin\n");
 #endif
+#ifdef DEBUG_PRINT_STATS
+    clock_t start = clock();
+#endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    switch (vm.gcPhase) {
+        case GC_IDLE:
+#ifdef GENERATIONAL_GC
+            // Collect the nursery every GC_NURSERY_SIZE bytes. Right after a collection the heap is all old objects,
+            // so once what's left after one has grown past nextMajorGC, it's time for a major collection.
+            if (vm.oldBytes <= vm.nextMajorGC) {
+                minorCollection();
+                vm.oldBytes = vm.bytesAllocated;
+                vm.nextGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+#ifdef DEBUG_PRINT_STATS
+                vm.minorCollections++;
+#endif
+                break;
+            }
+#endif
+            startMajorCollection();
+            vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+#ifdef DEBUG_PRINT_STATS
+            vm.majorCollections++;
+#endif
+            break;
+        case GC_MARKING:
+            if (traceSome(GC_WORK_BUDGET)) finishMarking();
+            vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+            break;
+        case GC_SWEEPING:
+            if (!sweepSome(GC_WORK_BUDGET)) {
+                vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+                break;
+            }
+
+            vm.gcPhase = GC_IDLE;
+            vm.oldBytes = vm.bytesAllocated;
+            vm.nextMajorGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef GENERATIONAL_GC
+            vm.nextGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+#else
+            vm.nextGC = vm.nextMajorGC;
+#endif
+            break;
+    }
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_PRINT_STATS
+    double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+    vm.gcPauses++;
+    vm.gcSeconds += pause;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+#endif
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -231,13 +554,22 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+static void freeList(Obj* object) {
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() {
+    freeList(vm.objects);
+    freeList(vm.sweepingObjects);
+    freeList(vm.oldObjects);
 
     free(vm.grayStack);
+    free(vm.remembered);
+#ifdef POOL_ALLOCATOR
+    freePools();
+#endif
 }
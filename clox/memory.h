@@ -16,9 +16,33 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#define IS_MARKED(object) ((object)->mark == vm.markEpoch)
+
+// Any code that stores a reference into an existing object has to run the write barrier on that object afterwards.
+// While a major collection is marking, a marked object that's written to gets grayed again (see rememberObject()).
+// In generational mode the barrier also remembers old objects written to between collections: a minor collection only
+// traces young objects, so an old object that now points at a young one has to be traced too. Locals, the stack and
+// globals are roots that every collection traces, so writes to those don't need it.
+#ifdef GENERATIONAL_GC
+#define WRITE_BARRIER(object) \
+    do { \
+        Obj* barrierObject = (Obj*)(object); \
+        if (IS_MARKED(barrierObject) && !barrierObject->isRemembered) rememberObject(barrierObject); \
+    } while (false)
+#else
+#define WRITE_BARRIER(object) \
+    do { \
+        Obj* barrierObject = (Obj*)(object); \
+        if (vm.gcPhase == GC_MARKING && IS_MARKED(barrierObject) && !barrierObject->isRemembered) { \
+            rememberObject(barrierObject); \
+        } \
+    } while (false)
+#endif
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* object);
 void markValue(Value value);
+void rememberObject(Obj* object);
 void collectGarbage();
 void freeObjects();
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -9,17 +10,24 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+// Initializes the header of a freshly allocated object and puts it on the young list, where the GC can find it.
+static void linkObject(Obj* object, size_t size, ObjType type) {
     object->type = type;
-    object->isMarked = false;
+    object->mark = 0;
+    object->isRemembered = false;
     object->next = vm.objects;
     vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %s\n", (void*)object, size, objTypeToString(type));
+#else
+    (void)size; // Only needed for the log.
 #endif
+}
 
+static Obj* allocateObject(size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    linkObject(object, size, type);
     return object;
 }
 
@@ -34,13 +42,23 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    klass->superclass = NULL;
+    klass->rootShape = NULL;
+
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    WRITE_BARRIER(klass);
+    pop();
     return klass;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    initTable(&instance->dictionary);
     return instance;
 }
 
@@ -61,6 +79,7 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -72,11 +91,83 @@ ObjNative* newNative(NativeFn function) {
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, u_int32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+
+    if (parent != NULL) {
+        // Each shape keeps its own complete slot table so that a lookup is one probe instead of a walk up the parents.
+        push(OBJ_VAL(shape));
+        tableAddAll(&parent->slots, &shape->slots);
+        tableSet(&shape->slots, name, NUMBER_VAL(parent->fieldCount));
+        shape->fieldCount = parent->fieldCount + 1;
+        WRITE_BARRIER(shape);
+        pop();
+    }
+    return shape;
+}
+
+// Returns the slot that field `name` lives in for instances of `shape`, or -1 if they don't have it.
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+// Returns the shape an instance of `shape` moves to when it gains field `name`.
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return (ObjShape*)AS_OBJ(next);
+
+    ObjShape* child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    WRITE_BARRIER(shape);
+    pop();
+    return child;
+}
+
+void ensureFieldCapacity(ObjInstance* instance, int count) {
+    if (count <= instance->fieldCapacity) return;
+
+    // Most instances have a handful of fields, so start smaller than GROW_CAPACITY would.
+    int oldCapacity = instance->fieldCapacity;
+    instance->fieldCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, instance->fieldCapacity);
+}
+
+void deleteField(ObjInstance* instance, ObjString* name) {
+    if (instance->shape != NULL) {
+        if (shapeSlot(instance->shape, name) == -1) return;
+
+        // Switch to dictionary mode: copy every field into the table, then drop the shape and the array.
+        Table* slots = &instance->shape->slots;
+        for (int i = 0; i < slots->capacity; i++) {
+            Entry* entry = &slots->entries[i];
+            if (entry->key == NULL) continue;
+            tableSet(&instance->dictionary, entry->key, instance->fields[(int)AS_NUMBER(entry->value)]);
+        }
+        WRITE_BARRIER(instance);
+
+        instance->shape = NULL;
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+        instance->fields = NULL;
+        instance->fieldCapacity = 0;
+    }
+
+    tableDelete(&instance->dictionary, name);
+}
+
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Puts a new string on the young list and in the intern table.
+static ObjString* registerString(ObjString* string, uint32_t hash) {
     string->hash = hash;
+    linkObject((Obj*)string, STRING_SIZE(string->length), OBJ_STRING);
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -85,6 +176,32 @@ static ObjString* allocateString(char* chars, int length, u_int32_t hash) {
     return string;
 }
 
+#ifdef WORD_HASH
+// Hashes a word at a time: each eight bytes are mixed in with one multiply, and the shift afterwards folds the high bits
+// back down so every byte gets a say in the low bits, which are the ones the table uses to pick a bucket. A final
+// avalanche step makes up for how little mixing short keys (most identifiers fit in one or two words) get.
+static uint32_t hashString(const char* key, int length) {
+    uint64_t hash = (uint64_t)length * 0x9e3779b97f4a7c15u;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+        hash ^= hash >> 32;
+    }
+    if (i < length) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, length - i);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9u;
+        hash ^= hash >> 32;
+    }
+
+    hash ^= hash >> 29;
+    hash *= 0x94d049bb133111ebu;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+#else
 static uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
@@ -93,26 +210,104 @@ static uint32_t hashString(const char* key, int length) {
     }
     return hash;
 }
+#endif
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+// Looks up an interned string. The sweep phase of a major collection runs alongside the program, so the string found
+// might be garbage that just hasn't been swept yet. Handing it out makes it live again, so mark it to save it.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL && vm.gcPhase == GC_SWEEPING) interned->obj.mark = vm.markEpoch;
+    return interned;
+}
+
+// Allocates a string with room for `length` characters for the caller to fill in before handing it to internString().
+// Until then the GC doesn't know about it, so the caller mustn't allocate anything else in between.
+ObjString* newString(int length) {
+    ObjString* string = (ObjString*)reallocate(NULL, 0, STRING_SIZE(length));
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Returns the interned string with the same characters as a string from newString(). If there already is one the new
+// string is freed, otherwise it becomes the interned one.
+ObjString* internString(ObjString* string) {
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = findInterned(string->chars, string->length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        reallocate(string, STRING_SIZE(string->length), 0);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return registerString(string, hash);
 }
 
 ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    return registerString(string, hash);
+}
+
+// A rope that's been flattened already can hand over its string, so the rope itself can be collected.
+static Obj* ropePiece(Obj* piece) {
+    if (piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat != NULL) return (Obj*)((ObjRope*)piece)->flat;
+    return piece;
+}
+
+static int pieceLength(Obj* piece) {
+    return piece->type == OBJ_ROPE ? ((ObjRope*)piece)->length : ((ObjString*)piece)->length;
+}
+
+ObjRope* newRope(Obj* left, Obj* right) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->left = ropePiece(left);
+    rope->right = ropePiece(right);
+    rope->length = pieceLength(rope->left) + pieceLength(rope->right);
+    rope->flat = NULL;
+    return rope;
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = newString(rope->length);
+
+    // Fill the string in from the end, taking right-hand pieces first and leaving left-hand ones for later. Appending
+    // in a loop makes ropes that lean to the left, and those never have more than one piece waiting.
+    char* end = string->chars + rope->length;
+    Obj** pending = NULL;
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+    Obj* piece = (Obj*)rope;
+    for (;;) {
+        if (piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat == NULL) {
+            if (pendingCapacity < pendingCount + 1) {
+                pendingCapacity = GROW_CAPACITY(pendingCapacity);
+                pending = (Obj**)realloc(pending, sizeof(Obj*) * pendingCapacity);
+                if (pending == NULL) exit(1);
+            }
+            pending[pendingCount++] = ((ObjRope*)piece)->left;
+            piece = ((ObjRope*)piece)->right;
+            continue;
+        }
+
+        ObjString* chars = piece->type == OBJ_ROPE ? ((ObjRope*)piece)->flat : (ObjString*)piece;
+        end -= chars->length;
+        memcpy(end, chars->chars, chars->length);
+
+        if (pendingCount == 0) break;
+        piece = pending[--pendingCount];
+    }
+    free(pending);
+
+    rope->flat = internString(string);
+    rope->left = NULL;
+    rope->right = NULL;
+    WRITE_BARRIER(rope);
+    return rope->flat;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -156,6 +351,18 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("<shape>");
+            break;
+        case OBJ_ROPE:
+            // Flattening allocates, which isn't safe everywhere this gets called (like the GC's logging), so it's up to
+            // the caller to flatten a rope first if it wants to see the characters.
+            if (AS_ROPE(value)->flat != NULL) {
+                printf("%s", AS_ROPE(value)->flat->chars);
+            } else {
+                printf("<rope>");
+            }
+            break;
     }
 }
 
@@ -175,6 +382,10 @@ char* objTypeToString(ObjType type) {
             return "<native fn>";
         case OBJ_UPVALUE:
             return "upvalue";
+        case OBJ_SHAPE:
+            return "shape";
+        case OBJ_ROPE:
+            return "rope";
     }
 
     return "unknown";
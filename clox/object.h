@@ -15,11 +15,14 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_ROPE,
 } ObjType;
 
 struct Obj {
     ObjType type;
-    bool isMarked;
+    uint8_t mark;      // Marked if equal to vm.markEpoch, see IS_MARKED.
+    bool isRemembered; // Already taken care of by WRITE_BARRIER.
     struct Obj* next;
 };
 
@@ -27,6 +30,7 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxSlots; // The most stack slots a call can use, see maxStackDepth().
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
@@ -38,13 +42,26 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// The characters live right after the header, so a string is a single allocation.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
+// A rope is a string concatenation that hasn't been carried out yet. Appending to a string in a loop builds a chain of
+// ropes instead of copying the whole string every time round, and the characters are only copied once, by
+// flattenRope(), when something needs the actual string: printing it or comparing it. The result is interned and cached
+// in `flat`, and the pieces are let go of so they can be collected.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;       // An ObjString or another ObjRope, NULL once flattened.
+    Obj* right;
+    ObjString* flat; // The flattened string, NULL until it's needed.
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     // When this is "open", meaning the variable it points to is still on the stack, location will point to the location
@@ -60,23 +77,46 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
-} ObjClosure;
+};
 
-typedef struct {
+// A shape (a "hidden class") describes the layout of an instance's fields: which fields it has and the slot each one
+// lives in. Instances of the same class that add the same fields in the same order share a shape. Shapes form a tree
+// rooted at the class's empty shape; adding a field to an instance moves it along a transition to a child shape, which
+// is created the first time any instance takes that transition.
+struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name;   // The field this shape added to its parent, NULL for the root.
+    int fieldCount;
+    Table slots;       // Field name -> slot index, for every field in the shape.
+    Table transitions; // Field name -> the child shape that adds it.
+};
+
+// A class's method table starts out with only the methods it declares itself. Inherited ones are copied down from the
+// superclass chain the first time they're looked up, see findMethod() in vm.c.
+struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
-} ObjClass;
+    struct ObjClass* superclass;
+    ObjShape* rootShape;
+};
 
+// Fields normally live in a flat array laid out by the instance's shape. Deleting a field would leave a hole the shape
+// tree can't describe, so the instance switches to "dictionary mode" instead: shape becomes NULL and its fields move
+// into the `dictionary` table for the rest of its life.
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields;
+    int fieldCapacity;
+    Table dictionary;
 } ObjInstance;
 
 typedef struct {
@@ -91,15 +131,24 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+ObjRope* newRope(Obj* left, Obj* right);
+ObjString* newString(int length);
+ObjString* internString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
+ObjString* flattenRope(ObjRope* rope);
 ObjUpvalue* newUpvalue(Value* slot);
+int shapeSlot(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+void ensureFieldCapacity(ObjInstance* instance, int count);
+void deleteField(ObjInstance* instance, ObjString* name);
 void printObject(Value value);
 char* objTypeToString(ObjType type);
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
@@ -108,6 +157,7 @@ char* objTypeToString(ObjType type);
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
@@ -120,4 +170,19 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Anything that behaves as a string in Lox: a string, or a rope standing in for one.
+static inline bool isStringOrRope(Value value) {
+    return IS_STRING(value) || IS_ROPE(value);
+}
+
+// The length of a string or rope, which is known without flattening.
+static inline int stringLength(Value value) {
+    return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
+// The actual string behind a string or rope. Flattening a rope allocates, so the rope has to be reachable.
+static inline ObjString* asFlatString(Value value) {
+    return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
+
 #endif //CLOX_OBJECT_H
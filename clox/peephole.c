@@ -0,0 +1,715 @@
+#include <stdlib.h>
+
+#include "peephole.h"
+#include "memory.h"
+#include "object.h"
+
+// The peephole pass runs over a finished chunk (see endCompiler) and replaces a few hot instruction sequences with a
+// single superinstruction, so the VM does one dispatch where it used to do two or three. The sequences were picked by
+// counting executed instruction triples over the scripts in benchmark/:
+//
+//   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD      -> OP_ADD_LOCALS a b
+//   OP_CONSTANT k, OP_ADD                       -> OP_ADD_CONSTANT k         (i = i + 1)
+//   OP_SET_LOCAL n, OP_POP                      -> OP_SET_LOCAL_POP n        (assignment statements)
+//   OP_LESS, OP_JUMP_IF_FALSE off, OP_POP       -> OP_LESS_JUMP_IF_FALSE off (loop and if conditions)
+//   OP_EQUAL, OP_NOT                            -> OP_NOT_EQUAL              (!(a == b))
+//
+// Fusing makes the code shorter, so every jump has to be re-pointed afterwards. A sequence is only fused if no jump
+// lands in the middle of it.
+//
+// In REGISTER_BYTECODE builds translateRegisters() (at the end of this file) runs first, and this pass only fuses what
+// the translation left as stack code.
+
+static int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_POP:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_PRINT:
+        case OP_NEGATE:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_NOT_EQUAL:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_SUPER:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_DEL_PROPERTY:
+        case OP_ADD_CONSTANT:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_SUPER_METHOD:
+        case OP_CALL_METHOD:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCALS:
+        case OP_LESS_JUMP_IF_FALSE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_METHOD:
+            return 4;
+        case OP_INVOKE:
+            return 5;
+        case OP_MOVE:
+        case OP_LOAD_CONSTANT:
+            return 3;
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RR:
+        case OP_DIVIDE_RK:
+        case OP_ADD_RR_SET:
+        case OP_ADD_RK_SET:
+        case OP_SUBTRACT_RR_SET:
+        case OP_SUBTRACT_RK_SET:
+        case OP_MULTIPLY_RR_SET:
+        case OP_MULTIPLY_RK_SET:
+        case OP_DIVIDE_RR_SET:
+        case OP_DIVIDE_RK_SET:
+            return 4;
+        case OP_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_NOT_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_LESS_RR_JUMP_IF_FALSE:
+        case OP_LESS_RK_JUMP_IF_FALSE:
+        case OP_LESS_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_LESS_EQUAL_RK_JUMP_IF_FALSE:
+        case OP_GREATER_RR_JUMP_IF_FALSE:
+        case OP_GREATER_RK_JUMP_IF_FALSE:
+        case OP_GREATER_EQUAL_RR_JUMP_IF_FALSE:
+        case OP_GREATER_EQUAL_RK_JUMP_IF_FALSE:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_WIDE: {
+            // The prefix, plus a second byte for the first operand. A wide closure widens its upvalue indexes as well.
+            if (chunk->code[offset + 1] == OP_CLOSURE) {
+                int constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+                return 4 + AS_FUNCTION(chunk->constants.values[constant])->upvalueCount * 3;
+            }
+            return 2 + instructionLength(chunk, offset + 1);
+        }
+    }
+
+    return 1; // Unreachable.
+}
+
+static bool isJump(uint8_t instruction) {
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP ||
+           instruction == OP_LESS_JUMP_IF_FALSE ||
+           (instruction >= OP_EQUAL_RR_JUMP_IF_FALSE && instruction <= OP_GREATER_EQUAL_RK_JUMP_IF_FALSE);
+}
+
+// Every jump's 16-bit distance is its last operand, counted from the end of the instruction.
+static int jumpTarget(Chunk* chunk, int offset) {
+    int end = offset + instructionLength(chunk, offset);
+    uint16_t jump = (uint16_t)((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+    if (chunk->code[offset] == OP_LOOP) return end - jump;
+    return end + jump;
+}
+
+static void findJumpTargets(Chunk* chunk, bool* isTarget) {
+    for (int i = 0; i <= chunk->count; i++) isTarget[i] = false;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) isTarget[jumpTarget(chunk, offset)] = true;
+    }
+}
+
+// Re-points the jumps in `rewritten`, which is `chunk` with some code replaced. The jump at rewritten offset
+// emitted[i] came from the one at original offset sources[i], and newOffsets maps every original instruction, and
+// the end of the chunk, to where it starts in the rewritten code.
+static void repointJumps(Chunk* chunk, Chunk* rewritten, const int* newOffsets, const int* sources,
+                         const int* emitted, int jumpCount) {
+    for (int i = 0; i < jumpCount; i++) {
+        int from = emitted[i];
+        int to = newOffsets[jumpTarget(chunk, sources[i])];
+        int end = from + instructionLength(rewritten, from);
+        int jump = rewritten->code[from] == OP_LOOP ? end - to : to - end;
+        rewritten->code[end - 2] = (jump >> 8) & 0xff;
+        rewritten->code[end - 1] = jump & 0xff;
+    }
+}
+
+// Keeps the chunk's constants and caches, and swaps in the rewritten code and line table.
+static void replaceCode(Chunk* chunk, Chunk* rewritten) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = rewritten->code;
+    chunk->count = rewritten->count;
+    chunk->capacity = rewritten->capacity;
+    chunk->lines = rewritten->lines;
+    chunk->lineCount = rewritten->lineCount;
+    chunk->lineCapacity = rewritten->lineCapacity;
+}
+
+// Returns true if `length` consecutive instructions starting at `offset` can be fused: they all exist and nothing jumps
+// to any of them except the first.
+static bool canFuse(Chunk* chunk, const bool* isTarget, int offset, int length) {
+    for (int i = 1; i < length; i++) {
+        offset += instructionLength(chunk, offset);
+        if (offset >= chunk->count || isTarget[offset]) return false;
+    }
+    return true;
+}
+
+static uint8_t opAt(Chunk* chunk, int offset, int skip) {
+    for (int i = 0; i < skip; i++) {
+        offset += instructionLength(chunk, offset);
+        if (offset >= chunk->count) return OP_RETURN;
+    }
+    return chunk->code[offset];
+}
+
+void peepholeOptimize(Chunk* chunk) {
+    if (chunk->count == 0) return;
+
+    // newOffsets maps the offset of every original instruction to where it starts in the rewritten code, with one
+    // extra slot for the end of the chunk. jumpSources remembers, for every jump we emit, where it was in the original,
+    // and jumpsEmitted where it is now.
+    bool* isTarget = ALLOCATE(bool, chunk->count + 1);
+    int* newOffsets = ALLOCATE(int, chunk->count + 1);
+    int* jumpSources = ALLOCATE(int, chunk->count);
+    int* jumpsEmitted = ALLOCATE(int, chunk->count);
+    int jumpCount = 0;
+    findJumpTargets(chunk, isTarget);
+
+    Chunk optimized;
+    initChunk(&optimized);
+
+    int offset = 0;
+    while (offset < chunk->count) {
+        int line = getLine(chunk, offset);
+        uint8_t instruction = chunk->code[offset];
+        int length = instructionLength(chunk, offset);
+        newOffsets[offset] = optimized.count;
+
+        if (instruction == OP_GET_LOCAL && opAt(chunk, offset, 1) == OP_GET_LOCAL &&
+            opAt(chunk, offset, 2) == OP_ADD && canFuse(chunk, isTarget, offset, 3)) {
+            writeChunk(&optimized, OP_ADD_LOCALS, line);
+            writeChunk(&optimized, chunk->code[offset + 1], line);
+            writeChunk(&optimized, chunk->code[offset + 3], line);
+            offset += 5;
+        } else if (instruction == OP_CONSTANT && opAt(chunk, offset, 1) == OP_ADD &&
+                   canFuse(chunk, isTarget, offset, 2)) {
+            writeChunk(&optimized, OP_ADD_CONSTANT, line);
+            writeChunk(&optimized, chunk->code[offset + 1], line);
+            offset += 3;
+        } else if (instruction == OP_SET_LOCAL && opAt(chunk, offset, 1) == OP_POP &&
+                   canFuse(chunk, isTarget, offset, 2)) {
+            writeChunk(&optimized, OP_SET_LOCAL_POP, line);
+            writeChunk(&optimized, chunk->code[offset + 1], line);
+            offset += 3;
+        } else if (instruction == OP_LESS && opAt(chunk, offset, 1) == OP_JUMP_IF_FALSE &&
+                   opAt(chunk, offset, 2) == OP_POP && canFuse(chunk, isTarget, offset, 3)) {
+            // The jump operand is patched below. Point it at the original OP_JUMP_IF_FALSE's target.
+            jumpSources[jumpCount] = offset + 1;
+            jumpsEmitted[jumpCount++] = optimized.count;
+            writeChunk(&optimized, OP_LESS_JUMP_IF_FALSE, line);
+            writeChunk(&optimized, 0xff, line);
+            writeChunk(&optimized, 0xff, line);
+            offset += 5;
+        } else if (instruction == OP_EQUAL && opAt(chunk, offset, 1) == OP_NOT &&
+                   canFuse(chunk, isTarget, offset, 2)) {
+            writeChunk(&optimized, OP_NOT_EQUAL, line);
+            offset += 2;
+        } else {
+            if (isJump(instruction)) {
+                jumpSources[jumpCount] = offset;
+                jumpsEmitted[jumpCount++] = optimized.count;
+            }
+            for (int i = 0; i < length; i++) {
+                writeChunk(&optimized, chunk->code[offset + i], line);
+            }
+            offset += length;
+        }
+    }
+    newOffsets[chunk->count] = optimized.count;
+    repointJumps(chunk, &optimized, newOffsets, jumpSources, jumpsEmitted, jumpCount);
+
+    FREE_ARRAY(bool, isTarget, chunk->count + 1);
+    FREE_ARRAY(int, newOffsets, chunk->count + 1);
+    FREE_ARRAY(int, jumpSources, chunk->count);
+    FREE_ARRAY(int, jumpsEmitted, chunk->count);
+    replaceCode(chunk, &optimized);
+}
+
+// How much an instruction changes the height of the value stack.
+static int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_METHOD:
+        case OP_ADD_LOCALS:
+            return 1;
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_GET_PROPERTY:
+        case OP_GET_SUPER_METHOD:
+        case OP_ADD_CONSTANT:
+            return 0;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GET_SUPER:
+        case OP_DEFINE_GLOBAL:
+        case OP_POP:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_SET_PROPERTY:
+        case OP_DEL_PROPERTY:
+        case OP_SET_LOCAL_POP:
+            return -1;
+        case OP_LESS_JUMP_IF_FALSE:
+            return -2;
+        case OP_CALL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        case OP_CALL_METHOD:
+            return -chunk->code[offset + 1] - 1;
+        case OP_WIDE:
+            // The argument count comes after the name, which is one byte further along.
+            switch (chunk->code[offset + 1]) {
+                case OP_INVOKE: return -chunk->code[offset + 4];
+                case OP_SUPER_INVOKE: return -chunk->code[offset + 4] - 1;
+                default: return stackEffect(chunk, offset + 1);
+            }
+    }
+
+    return 0; // Unreachable.
+}
+
+// Works out the height of the stack before each instruction of stack code (not register code, whose instructions
+// don't have a fixed effect), which is also the slot the next value pushed goes in.
+static void stackHeights(Chunk* chunk, int arity, int* heights) {
+    // Walk the code in order, tracking the stack height. Code right after an unconditional jump is only reached by
+    // jumping to it, so every forward jump records the height it arrives with, and an instruction starts from the
+    // larger of that and the height the code before it left. Loops jump back to a height they've already been at.
+    for (int i = 0; i <= chunk->count; i++) heights[i] = 0;
+
+    int depth = 1 + arity; // Slot zero holds the function or receiver, then come the parameters.
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (heights[offset] > depth) depth = heights[offset];
+        heights[offset] = depth;
+
+        uint8_t instruction = chunk->code[offset];
+        if (isJump(instruction) && instruction != OP_LOOP) {
+            // A jump leaves the condition on the stack, including the fused less-than, which pushes it back.
+            int target = jumpTarget(chunk, offset);
+            int arriving = instruction == OP_LESS_JUMP_IF_FALSE ? depth - 1 : depth;
+            if (arriving > heights[target]) heights[target] = arriving;
+        }
+
+        depth += stackEffect(chunk, offset);
+    }
+}
+
+int maxStackDepth(Chunk* chunk, int arity) {
+    int* heights = ALLOCATE(int, chunk->count + 1);
+    stackHeights(chunk, arity, heights);
+
+    int maxDepth = 1 + arity;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        // On a string operand, the fused adds push their operands back before concatenating, one more than the
+        // result they leave.
+        uint8_t instruction = chunk->code[offset];
+        int peak = heights[offset] + stackEffect(chunk, offset);
+        if (instruction == OP_ADD_LOCALS || instruction == OP_ADD_CONSTANT) peak++;
+        if (peak > maxDepth) maxDepth = peak;
+    }
+
+    FREE_ARRAY(int, heights, chunk->count + 1);
+    return maxDepth;
+}
+
+#ifdef REGISTER_BYTECODE
+// Register translation
+//
+// In REGISTER_BYTECODE builds translateRegisters() rewrites a function's stack code into the three-address register
+// instructions in chunk.h before the peephole pass runs. Locals already live in frame slots, and every value on the
+// stack sits in the slot at its depth, which stackHeights() works out ahead of time, so a slot number can name a local
+// or a temporary alike. `total = total + j * 2 - j`, eight instructions after fusing, becomes
+//
+//   OP_GET_LOCAL total, OP_MULTIPLY_RK t j 2, OP_ADD_RR t-1 t-1 t, OP_SUBTRACT_RR t-1 t-1 j, OP_SET_LOCAL_POP total
+//
+// and `i = i + 1` a single OP_ADD_RK_SET i i 1.
+//
+// Loads of locals and constants aren't emitted straight away. They're kept pending, and an instruction that can take
+// them as operands reads them from their slot or the constant table instead of the stack. Anything the translation
+// doesn't cover gets the pending loads emitted in front of it as the pushes they were, as does every jump and jump
+// target, so whenever a stack instruction runs or basic blocks meet, the stack is exactly what the stack code would
+// have left.
+//
+// The garbage collector only sees the stack up to vm.stackTop, so results kept on the stack are only written once
+// everything under them is on the stack for real: there's never a slot under vm.stackTop that nothing has written.
+// And a pending load of a local is emitted before anything stores into that local.
+
+#define MAX_PENDING 16
+
+// An OP_GET_LOCAL or OP_CONSTANT that hasn't been emitted yet.
+typedef struct {
+    uint8_t instruction;
+    uint8_t operand;
+    int line;
+} PendingLoad;
+
+// Where an instruction can read one of its operands from: a slot, or the constant table.
+typedef struct {
+    bool isConstant;
+    int index;
+} Operand;
+
+typedef struct {
+    Chunk* chunk;
+    Chunk code;
+    // The stack height before each of the original instructions. The pending loads are the top pendingCount values.
+    int* heights;
+    bool* isTarget;
+    PendingLoad pending[MAX_PENDING];
+    int pendingCount;
+    int* jumpSources;
+    int* jumpsEmitted;
+    int jumpCount;
+} Translation;
+
+// Emits all but the top `keep` pending loads, so everything under those is on the stack for real.
+static void flushPending(Translation* translation, int keep) {
+    int count = translation->pendingCount - keep;
+    for (int i = 0; i < count; i++) {
+        PendingLoad* load = &translation->pending[i];
+        writeChunk(&translation->code, load->instruction, load->line);
+        writeChunk(&translation->code, load->operand, load->line);
+    }
+    for (int i = 0; i < keep; i++) {
+        translation->pending[i] = translation->pending[count + i];
+    }
+    translation->pendingCount = keep;
+}
+
+static void addPending(Translation* translation, uint8_t instruction, uint8_t operand, int line) {
+    if (translation->pendingCount == MAX_PENDING) flushPending(translation, 0);
+    PendingLoad* load = &translation->pending[translation->pendingCount++];
+    load->instruction = instruction;
+    load->operand = operand;
+    load->line = line;
+}
+
+// Returns where to read the value `distance` down from the top of the stack, before the instruction at `offset`.
+static Operand operandAt(Translation* translation, int offset, int distance) {
+    Operand operand;
+    if (distance < translation->pendingCount) {
+        PendingLoad* load = &translation->pending[translation->pendingCount - 1 - distance];
+        operand.isConstant = load->instruction == OP_CONSTANT;
+        operand.index = load->operand;
+    } else {
+        operand.isConstant = false;
+        operand.index = translation->heights[offset] - 1 - distance;
+    }
+    return operand;
+}
+
+// Whether any of the pending loads, apart from the top `skip`, reads the local in `slot`.
+static bool pendingReads(Translation* translation, int slot, int skip) {
+    for (int i = 0; i < translation->pendingCount - skip; i++) {
+        PendingLoad* load = &translation->pending[i];
+        if (load->instruction == OP_GET_LOCAL && load->operand == slot) return true;
+    }
+    return false;
+}
+
+// Returns true if the instructions at `offset` are OP_SET_LOCAL then OP_POP, an assignment statement, and neither is a
+// jump target. The local goes in `slot`.
+static bool isAssignment(Translation* translation, int offset, int* slot) {
+    Chunk* chunk = translation->chunk;
+    if (chunk->code[offset] != OP_SET_LOCAL || chunk->code[offset + 2] != OP_POP) return false;
+    if (translation->isTarget[offset] || translation->isTarget[offset + 2]) return false;
+    *slot = chunk->code[offset + 1];
+    return true;
+}
+
+static void emitRegisterInstruction(Translation* translation, uint8_t instruction, int a, int b, int c, int line) {
+    writeChunk(&translation->code, instruction, line);
+    writeChunk(&translation->code, (uint8_t)a, line);
+    writeChunk(&translation->code, (uint8_t)b, line);
+    writeChunk(&translation->code, (uint8_t)c, line);
+}
+
+static uint8_t arithmeticInstruction(uint8_t instruction, bool constant, bool set) {
+    switch (instruction) {
+        case OP_ADD:
+            if (set) return constant ? OP_ADD_RK_SET : OP_ADD_RR_SET;
+            return constant ? OP_ADD_RK : OP_ADD_RR;
+        case OP_SUBTRACT:
+            if (set) return constant ? OP_SUBTRACT_RK_SET : OP_SUBTRACT_RR_SET;
+            return constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+        case OP_MULTIPLY:
+            if (set) return constant ? OP_MULTIPLY_RK_SET : OP_MULTIPLY_RR_SET;
+            return constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+        default:
+            if (set) return constant ? OP_DIVIDE_RK_SET : OP_DIVIDE_RR_SET;
+            return constant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+    }
+}
+
+// Translates the arithmetic instruction at `offset`, and the assignment after it if it stores the result straight into
+// a local. Returns how much of the original code that covered, or 0 to leave it as stack code.
+static int translateArithmetic(Translation* translation, int offset) {
+    Chunk* chunk = translation->chunk;
+    uint8_t instruction = chunk->code[offset];
+    int line = getLine(chunk, offset);
+    Operand left = operandAt(translation, offset, 1);
+    Operand right = operandAt(translation, offset, 0);
+    if (left.isConstant) {
+        // Only the right operand can be a constant. Multiplication only works on numbers, so its operands can be
+        // swapped, but `"a" + b` isn't `b + "a"`.
+        if (right.isConstant || instruction != OP_MULTIPLY) return 0;
+        Operand swap = left;
+        left = right;
+        right = swap;
+    }
+
+    int pendingOperands = translation->pendingCount < 2 ? translation->pendingCount : 2;
+    int firstPending = translation->heights[offset] - translation->pendingCount;
+    int local;
+    if (pendingOperands == 2 && isAssignment(translation, offset + 1, &local) && local < firstPending &&
+        !pendingReads(translation, local, 2)) {
+        emitRegisterInstruction(translation, arithmeticInstruction(instruction, right.isConstant, true), local,
+                                left.index, right.index, line);
+        translation->pendingCount -= 2;
+        return 4;
+    }
+
+    // The result goes where the left operand was.
+    int result = translation->heights[offset] - 2;
+    if (result > UINT8_MAX || left.index > UINT8_MAX || right.index > UINT8_MAX) return 0;
+
+    flushPending(translation, pendingOperands);
+    emitRegisterInstruction(translation, arithmeticInstruction(instruction, right.isConstant, false), result,
+                            left.index, right.index, line);
+    translation->pendingCount = 0;
+    return 1;
+}
+
+static uint8_t comparisonInstruction(uint8_t instruction, bool constant) {
+    switch (instruction) {
+        case OP_EQUAL:         return constant ? OP_EQUAL_RK_JUMP_IF_FALSE : OP_EQUAL_RR_JUMP_IF_FALSE;
+        case OP_NOT_EQUAL:     return constant ? OP_NOT_EQUAL_RK_JUMP_IF_FALSE : OP_NOT_EQUAL_RR_JUMP_IF_FALSE;
+        case OP_LESS:          return constant ? OP_LESS_RK_JUMP_IF_FALSE : OP_LESS_RR_JUMP_IF_FALSE;
+        case OP_LESS_EQUAL:    return constant ? OP_LESS_EQUAL_RK_JUMP_IF_FALSE : OP_LESS_EQUAL_RR_JUMP_IF_FALSE;
+        case OP_GREATER:       return constant ? OP_GREATER_RK_JUMP_IF_FALSE : OP_GREATER_RR_JUMP_IF_FALSE;
+        default:               return constant ? OP_GREATER_EQUAL_RK_JUMP_IF_FALSE : OP_GREATER_EQUAL_RR_JUMP_IF_FALSE;
+    }
+}
+
+// The comparison that gives the same answer with its operands swapped.
+static uint8_t mirrorComparison(uint8_t instruction) {
+    switch (instruction) {
+        case OP_LESS:          return OP_GREATER;
+        case OP_LESS_EQUAL:    return OP_GREATER_EQUAL;
+        case OP_GREATER:       return OP_LESS;
+        case OP_GREATER_EQUAL: return OP_LESS_EQUAL;
+        default:               return instruction;
+    }
+}
+
+// Translates a comparison of two pending loads that's the condition of a jump, `OP_JUMP_IF_FALSE off, OP_POP`. An
+// OP_EQUAL can have an OP_NOT in between, for `!(a == b)`. Returns how much of the original code that covered, or 0 to leave it as
+// stack code.
+static int translateComparison(Translation* translation, int offset) {
+    Chunk* chunk = translation->chunk;
+    uint8_t instruction = chunk->code[offset];
+    int line = getLine(chunk, offset);
+    int jump = offset + 1;
+    if (instruction == OP_EQUAL && chunk->code[jump] == OP_NOT && !translation->isTarget[jump]) {
+        instruction = OP_NOT_EQUAL;
+        jump++;
+    }
+    if (jump + 3 >= chunk->count || chunk->code[jump] != OP_JUMP_IF_FALSE || chunk->code[jump + 3] != OP_POP ||
+        translation->isTarget[jump] || translation->isTarget[jump + 3]) {
+        return 0;
+    }
+    if (translation->pendingCount < 2) return 0;
+
+    Operand left = operandAt(translation, offset, 1);
+    Operand right = operandAt(translation, offset, 0);
+    if (left.isConstant) {
+        if (right.isConstant) return 0;
+        Operand swap = left;
+        left = right;
+        right = swap;
+        instruction = mirrorComparison(instruction);
+    }
+
+    flushPending(translation, 2);
+    // The jump operand is patched afterwards, to point at the original OP_JUMP_IF_FALSE's target.
+    translation->jumpSources[translation->jumpCount] = jump;
+    translation->jumpsEmitted[translation->jumpCount++] = translation->code.count;
+    writeChunk(&translation->code, comparisonInstruction(instruction, right.isConstant), line);
+    writeChunk(&translation->code, (uint8_t)left.index, line);
+    writeChunk(&translation->code, (uint8_t)right.index, line);
+    writeChunk(&translation->code, 0xff, line);
+    writeChunk(&translation->code, 0xff, line);
+    translation->pendingCount = 0;
+    return jump + 4 - offset;
+}
+
+// Translates the instruction at `offset`, plus any that follow it and are covered by the same register instruction.
+// Returns how much of the original code was consumed.
+static int translateInstruction(Translation* translation, int offset) {
+    Chunk* chunk = translation->chunk;
+    uint8_t instruction = chunk->code[offset];
+    int line = getLine(chunk, offset);
+    int firstPending = translation->heights[offset] - translation->pendingCount;
+    int consumed = 0;
+
+    switch (instruction) {
+        case OP_GET_LOCAL:
+            // A local whose initializer is still pending hasn't been stored in its slot yet.
+            if (chunk->code[offset + 1] >= firstPending) flushPending(translation, 0);
+            addPending(translation, instruction, chunk->code[offset + 1], line);
+            return 2;
+        case OP_CONSTANT:
+            addPending(translation, instruction, chunk->code[offset + 1], line);
+            return 2;
+        case OP_POP:
+            // Nothing needs to happen to drop a load that was never done.
+            if (translation->pendingCount > 0) {
+                translation->pendingCount--;
+                return 1;
+            }
+            break;
+        case OP_SET_LOCAL: {
+            // Assigning a local or a constant to a local is a single move.
+            int local;
+            if (translation->pendingCount > 0 && isAssignment(translation, offset, &local) &&
+                local < firstPending && !pendingReads(translation, local, 1)) {
+                PendingLoad* load = &translation->pending[--translation->pendingCount];
+                writeChunk(&translation->code, load->instruction == OP_CONSTANT ? OP_LOAD_CONSTANT : OP_MOVE, line);
+                writeChunk(&translation->code, (uint8_t)local, line);
+                writeChunk(&translation->code, load->operand, line);
+                return 3;
+            }
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            consumed = translateArithmetic(translation, offset);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+            consumed = translateComparison(translation, offset);
+            break;
+    }
+    if (consumed > 0) return consumed;
+
+    // Everything else is stack code, and needs its operands on the stack.
+    flushPending(translation, 0);
+    int length = instructionLength(chunk, offset);
+    if (isJump(instruction)) {
+        translation->jumpSources[translation->jumpCount] = offset;
+        translation->jumpsEmitted[translation->jumpCount++] = translation->code.count;
+    }
+    for (int i = 0; i < length; i++) {
+        writeChunk(&translation->code, chunk->code[offset + i], line);
+    }
+    return length;
+}
+
+void translateRegisters(Chunk* chunk, int arity) {
+    if (chunk->count == 0) return;
+
+    Translation translation;
+    translation.chunk = chunk;
+    initChunk(&translation.code);
+    translation.heights = ALLOCATE(int, chunk->count + 1);
+    translation.isTarget = ALLOCATE(bool, chunk->count + 1);
+    translation.pendingCount = 0;
+    translation.jumpSources = ALLOCATE(int, chunk->count);
+    translation.jumpsEmitted = ALLOCATE(int, chunk->count);
+    translation.jumpCount = 0;
+    stackHeights(chunk, arity, translation.heights);
+    findJumpTargets(chunk, translation.isTarget);
+
+    // As in peepholeOptimize(), newOffsets maps every original instruction to where it starts in the new code. A jump
+    // target starts after the pending loads emitted for the code falling into it.
+    int* newOffsets = ALLOCATE(int, chunk->count + 1);
+    int offset = 0;
+    while (offset < chunk->count) {
+        if (translation.isTarget[offset]) flushPending(&translation, 0);
+        newOffsets[offset] = translation.code.count;
+        offset += translateInstruction(&translation, offset);
+    }
+    flushPending(&translation, 0);
+    newOffsets[chunk->count] = translation.code.count;
+    repointJumps(chunk, &translation.code, newOffsets, translation.jumpSources, translation.jumpsEmitted,
+                 translation.jumpCount);
+
+    FREE_ARRAY(int, translation.heights, chunk->count + 1);
+    FREE_ARRAY(bool, translation.isTarget, chunk->count + 1);
+    FREE_ARRAY(int, translation.jumpSources, chunk->count);
+    FREE_ARRAY(int, translation.jumpsEmitted, chunk->count);
+    FREE_ARRAY(int, newOffsets, chunk->count + 1);
+    replaceCode(chunk, &translation.code);
+}
+#endif
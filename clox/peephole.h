@@ -0,0 +1,14 @@
+#ifndef CLOX_PEEPHOLE_H
+#define CLOX_PEEPHOLE_H
+
+#include "chunk.h"
+
+void peepholeOptimize(Chunk* chunk);
+#ifdef REGISTER_BYTECODE
+// Rewrites stack code into register instructions where it can, see peephole.c.
+void translateRegisters(Chunk* chunk, int arity);
+#endif
+// The most value stack slots a call to the chunk's function can use, including slot zero and the parameters.
+int maxStackDepth(Chunk* chunk, int arity);
+
+#endif //CLOX_PEEPHOLE_H
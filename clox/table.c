@@ -19,26 +19,64 @@ void freeTable(Table* table) {
     initTable(table);
 }
 
+// Tables use Robin Hood hashing. Every key knows how far it sits from the slot its hash wants (its distance), and an
+// insert that meets a key closer to home than itself takes that slot and carries on inserting the evicted key instead.
+// That keeps every key close to home, and it means a lookup can stop as soon as it meets a key closer to home than the
+// one it's looking for: if ours were in the table, it would have evicted that one. Deletion shifts the rest of the
+// cluster back one slot instead of leaving a tombstone, so probe chains never fill up with dead entries.
+//
+// Capacities are always powers of two (GROW_CAPACITY doubles from 8), so wrapping an index around is a mask rather
+// than a division.
+
+static uint32_t distance(uint32_t hash, uint32_t index, uint32_t mask) {
+    return (index - (hash & mask)) & mask;
+}
+
+// Returns the entry holding `key`, or NULL.
 static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+    uint32_t mask = capacity - 1;
+    uint32_t index = key->hash & mask;
 
-    for (;;) {
+    for (uint32_t dist = 0;; dist++) {
+        Entry* entry = &entries[index];
+        if (entry->key == key) return entry;
+        if (entry->key == NULL || distance(entry->hash, index, mask) < dist) return NULL;
+
+        index = (index + 1) & mask;
+    }
+}
+
+// Puts `key` in the table, which must not already contain it and must have room. Returns where it ended up.
+static Entry* insertEntry(Entry* entries, int capacity, ObjString* key, uint32_t hash, Value value) {
+    uint32_t mask = capacity - 1;
+    uint32_t index = hash & mask;
+    Entry* inserted = NULL;
+
+    for (uint32_t dist = 0;; dist++) {
         Entry* entry = &entries[index];
         if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+            entry->key = key;
+            entry->hash = hash;
+            entry->value = value;
+            return inserted != NULL ? inserted : entry;
+        }
+
+        uint32_t entryDist = distance(entry->hash, index, mask);
+        if (entryDist < dist) {
+            // Take the slot from the key that's closer to home, and go on to find a new one for it.
+            Entry evicted = *entry;
+            entry->key = key;
+            entry->hash = hash;
+            entry->value = value;
+            if (inserted == NULL) inserted = entry;
+
+            key = evicted.key;
+            hash = evicted.hash;
+            value = evicted.value;
+            dist = entryDist;
         }
 
-        index = (index + 1) % capacity;
+        index = (index + 1) & mask;
     }
 }
 
@@ -46,7 +84,7 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
@@ -56,18 +94,14 @@ static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
+        entries[i].hash = 0;
         entries[i].value = NIL_VAL;
     }
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
-
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        insertEntry(entries, capacity, entry->key, entry->hash, entry->value);
     }
 
     FREE_ARRAY(Entry, table->entries, table->capacity);
@@ -76,30 +110,44 @@ static void adjustCapacity(Table* table, int capacity) {
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
+    if (table->count > 0) {
+        Entry* entry = findEntry(table->entries, table->capacity, key);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
+    }
+
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->count++;
+    insertEntry(table->entries, table->capacity, key, key->hash, value);
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    // Find the entry.
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry == NULL) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // Shift the keys after it back one slot, up to the end of the cluster or a key that's already home.
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = (uint32_t)(entry - table->entries);
+    for (;;) {
+        uint32_t next = (index + 1) & mask;
+        Entry* nextEntry = &table->entries[next];
+        if (nextEntry->key == NULL || distance(nextEntry->hash, next, mask) == 0) break;
+
+        table->entries[index] = *nextEntry;
+        index = next;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
     return true;
 }
 
@@ -115,27 +163,17 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = hash & mask;
+    for (uint32_t dist = 0;; dist++) {
         Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
+        if (entry->key == NULL || distance(entry->hash, index, mask) < dist) return NULL;
+        if (entry->hash == hash && entry->key->length == length && memcmp(entry->key->chars, chars, length) == 0) {
             // We found it.
             return entry->key;
         }
 
-        index = (index + 1) % table->capacity;
-    }
-}
-
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
-        }
+        index = (index + 1) & mask;
     }
 }
 
@@ -4,8 +4,11 @@
 #include "common.h"
 #include "value.h"
 
+// The key's hash is copied into the entry so that probing can work out distances and skip other keys without loading
+// the strings themselves.
 typedef struct {
     ObjString* key;
+    uint32_t hash;
     Value value;
 } Entry;
 
@@ -22,7 +25,6 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
 #endif
\ No newline at end of file
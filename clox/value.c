@@ -1,4 +1,4 @@
-#include <printf.h>
+#include <stdio.h>
 #include <string.h>
 #include "value.h"
 #include "memory.h"
@@ -28,6 +28,19 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("<undefined>");
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -35,16 +48,39 @@ void printValue(Value value) {
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: printf("<undefined>"); break;
     }
+#endif
+}
+
+// Strings are interned so they're equal exactly when they're the same object, but a rope isn't the same object as the
+// string it stands for. Only flatten when the lengths match, though; otherwise the answer is known already. Both values
+// have to be reachable, since flattening allocates.
+static bool ropesEqual(Value a, Value b) {
+    if (!isStringOrRope(a) || !isStringOrRope(b)) return false;
+    if (stringLength(a) != stringLength(b)) return false;
+    ObjString* flatA = asFlatString(a);
+    return flatA == asFlatString(b);
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles rather than as bits so that NaN != NaN, the same as the tagged union below.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return (IS_ROPE(a) || IS_ROPE(b)) && ropesEqual(a, b);
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return (IS_ROPE(a) || IS_ROPE(b)) && ropesEqual(a, b);
         default:         return false; // Unreachable.
     }
-}
\ No newline at end of file
+#endif
+}
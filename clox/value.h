@@ -5,12 +5,66 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Every Value is a single 64-bit word. Numbers are stored as plain doubles. Anything else hides inside the unused bits
+// of a quiet NaN: the quiet NaN bits below mark a non-number, the sign bit marks an Obj* (whose address sits in the low
+// 48 bits), and the lowest two bits tag the singletons nil, false and true.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_UNDEFINED 0 // 00. Never visible to Lox code, see UNDEFINED_VAL.
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value)     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// memcpy is the portable way to type-pun a double; compilers turn it into a plain register move.
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED, // Never visible to Lox code, see UNDEFINED_VAL.
 } ValueType;
 
 typedef struct {
@@ -24,6 +78,7 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
@@ -35,6 +90,18 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
+
+// UNDEFINED_VAL marks a global slot whose name the compiler has seen but whose `var`, `fun` or `class` hasn't run yet.
+// OP_GET_METHOD also leaves it on the stack in place of a receiver when the property it found is a field.
+
+// nil and false are falsey, everything else is truthy. The compiler uses this too, to fold conditions it can see are
+// constant.
+static inline bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
 
 typedef struct {
     int capacity;
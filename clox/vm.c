@@ -1,19 +1,45 @@
 #include <stdarg.h>
-#include <printf.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "image.h"
 #include "object.h"
 #include "memory.h"
 #include <time.h>
 
+// Direct-threaded dispatch relies on the labels-as-values extension. Anything else falls back to the portable switch,
+// as does building with -DCLOX_COMPUTED_GOTO=OFF.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 VM vm;
 
+#ifdef DEBUG_PRINT_STATS
+#define COUNT_CACHE_HIT() (vm.cacheHits++)
+#define COUNT_CACHE_MISS() (vm.cacheMisses++)
+#define COUNT_BOUND_METHOD() (vm.boundMethods++)
+#define COUNT_BOUND_METHOD_AVOIDED() (vm.boundMethodsAvoided++)
+#else
+#define COUNT_CACHE_HIT() do {} while (false)
+#define COUNT_CACHE_MISS() do {} while (false)
+#define COUNT_BOUND_METHOD() do {} while (false)
+#define COUNT_BOUND_METHOD_AVOIDED() do {} while (false)
+#endif
+
 static Value clockNative(int argCount, Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Helpers like newClass() and internString() push their objects to keep them safe from the GC while they allocate,
+// which takes a few slots on top of what the compiler counted for the running function.
+#define STACK_RESERVE 8
+// How many frames at either end of the call stack a runtime error shows.
+#define TRACE_FRAMES 10
+
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
@@ -28,10 +54,17 @@ static void runtimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep recursion can leave a lot of frames. Show the innermost and outermost calls and skip the middle.
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "[... %d more calls]\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES;
+            continue;
+        }
+
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction].line);
+        int instruction = (int)(frame->ip - function->chunk.code - 1);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -45,23 +78,67 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    pop();
     pop();
+}
+
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
     pop();
+    return index;
 }
 
 void initVM() {
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stackLimit = vm.stack + STACK_INITIAL;
+    if (vm.frames == NULL || vm.stack == NULL) exit(1);
     resetStack();
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.nextMajorGC = 1024 * 1024;
+    vm.oldBytes = 0;
     vm.objects = NULL;
+    vm.oldObjects = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.markEpoch = 1;
+    vm.sweepCursor = NULL;
+    vm.sweepingObjects = NULL;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+
+#ifdef DEBUG_PRINT_STATS
+    vm.instructionCount = 0;
+    vm.cacheHits = 0;
+    vm.cacheMisses = 0;
+    vm.boundMethods = 0;
+    vm.boundMethodsAvoided = 0;
+    vm.minorCollections = 0;
+    vm.majorCollections = 0;
+    vm.gcPauses = 0;
+    vm.gcSeconds = 0;
+    vm.gcMaxPause = 0;
+#endif
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
 
     vm.initString = NULL;
@@ -69,11 +146,39 @@ void initVM() {
     defineNative("clock", clockNative);
 }
 
+#ifdef DEBUG_PRINT_STATS
+static void printStats() {
+    printf("-- vm stats\n");
+    printf("   instructions dispatched: %llu\n", (unsigned long long)vm.instructionCount);
+    printf("   inline cache hits: %llu, misses: %llu\n",
+           (unsigned long long)vm.cacheHits, (unsigned long long)vm.cacheMisses);
+
+    printf("   bound methods allocated: %llu, avoided: %llu\n",
+           (unsigned long long)vm.boundMethods, (unsigned long long)vm.boundMethodsAvoided);
+
+    double total = (double)clock() / CLOCKS_PER_SEC;
+    printf("   gc: %llu minor, %llu major collections\n",
+           (unsigned long long)vm.minorCollections, (unsigned long long)vm.majorCollections);
+    printf("   gc pauses: %llu, %.3f ms max, %.3f ms avg\n", (unsigned long long)vm.gcPauses, vm.gcMaxPause * 1000,
+           vm.gcPauses == 0 ? 0.0 : vm.gcSeconds * 1000 / (double)vm.gcPauses);
+    printf("   gc time: %.3f s of %.3f s total (%.1f%%)\n", vm.gcSeconds, total,
+           total == 0 ? 0.0 : 100 * vm.gcSeconds / total);
+}
+#endif
+
 void freeVM() {
-    freeTable(&vm.globals);
+#ifdef DEBUG_PRINT_STATS
+    printStats();
+#endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    unmapImages();
+    free(vm.frames);
+    free(vm.stack);
 }
 
 void push(Value value) {
@@ -90,17 +195,56 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+// Moves the stack to a bigger allocation with room for at least `needed` more slots. Everything that points into the
+// stack has to move along with it: stackTop, every frame's slots and the open upvalues. The frames in run() pick up
+// the new slots when they reload after the call that grew the stack.
+static void growStack(int needed) {
+    int count = (int)(vm.stackTop - vm.stack);
+    int capacity = (int)(vm.stackLimit - vm.stack);
+    while (capacity < count + needed) capacity *= 2;
+
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm.stack, sizeof(Value) * count);
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackTop = stack + count;
+    vm.stackLimit = stack + capacity;
+}
+
+static bool growFrames() {
+    if (vm.frameCapacity == FRAMES_MAX) return false;
+
+    vm.frameCapacity = vm.frameCapacity * 2 > FRAMES_MAX ? FRAMES_MAX : vm.frameCapacity * 2;
+    vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+    if (vm.frames == NULL) exit(1);
+    return true;
+}
+
 static bool call(ObjClosure * closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    // The frame array never grows past FRAMES_MAX, so running out of room is the only time the cap needs checking.
+    if (vm.frameCount == vm.frameCapacity && !growFrames()) {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    // The function's slots start with the callee and the arguments, which are already on the stack.
+    int needed = closure->function->maxSlots + STACK_RESERVE;
+    if (vm.stackTop - argCount - 1 + needed > vm.stackLimit) growStack(needed - argCount - 1);
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -109,6 +253,23 @@ static bool call(ObjClosure * closure, int argCount) {
     return true;
 }
 
+// Looks up a method on a class. Subclasses don't get a copy of their superclass's methods when they're declared;
+// instead an inherited method is found by walking up the superclass chain the first time it's asked for, and copied
+// into the subclass's table so later lookups find it straight away. A class can't change once its declaration has run,
+// so the copies never go stale, and a subclass only ever holds the inherited methods that actually get used.
+static bool findMethod(ObjClass* klass, ObjString* name, Value* method) {
+    if (tableGet(&klass->methods, name, method)) return true;
+
+    for (ObjClass* superclass = klass->superclass; superclass != NULL; superclass = superclass->superclass) {
+        if (tableGet(&superclass->methods, name, method)) {
+            tableSet(&klass->methods, name, *method);
+            WRITE_BARRIER(klass);
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -123,7 +284,7 @@ static bool callValue(Value callee, int argCount) {
                 ObjClass *klass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
+                if (findMethod(klass, vm.initString, &initializer)) {
                     return call(AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
@@ -148,14 +309,131 @@ static bool callValue(Value callee, int argCount) {
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
+    COUNT_BOUND_METHOD_AVOIDED();
     return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+// Moves `way` to the front of the cache, pushing the least recently used receiver shape out if it's full.
+static void updateCache(InlineCache* cache, CacheWay way) {
+    // The cache belongs to the function running in the top frame, and now points at the way's shapes and method.
+    WRITE_BARRIER(vm.frames[vm.frameCount - 1].closure->function);
+
+    if (cache->ways[0].shape == way.shape) {
+        cache->ways[0] = way;
+        return;
+    }
+
+    int i = INLINE_CACHE_WAYS - 1;
+    for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+        if (cache->ways[j].shape == way.shape) {
+            i = j;
+            break;
+        }
+    }
+
+    for (; i > 0; i--) {
+        cache->ways[i] = cache->ways[i - 1];
+    }
+    cache->ways[0] = way;
+}
+
+// Looks up property `name` on `instance`, first through the instruction's inline cache and then, on a miss, through the
+// instance's fields and its class's methods, filling the cache for next time. Returns false if there's no such
+// property. Otherwise stores the field's value, or the method's closure, in `value`.
+static bool findProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value* value, bool* isMethod) {
+    ObjShape* shape = instance->shape;
+    if (shape != NULL) {
+        // The shape says exactly which fields the instance has, so a cached method hit also proves there's no field
+        // shadowing the method.
+        for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+            CacheWay* way = &cache->ways[i];
+            if (way->shape != shape) continue;
+
+            COUNT_CACHE_HIT();
+            if (way->fieldSlot != -1) {
+                *value = instance->fields[way->fieldSlot];
+                *isMethod = false;
+            } else {
+                *value = OBJ_VAL(way->method);
+                *isMethod = true;
+            }
+            return true;
+        }
+    }
+
+    COUNT_CACHE_MISS();
+    CacheWay way;
+    way.shape = shape;
+    way.transition = NULL;
+    way.fieldSlot = shape != NULL ? shapeSlot(shape, name) : -1;
+    way.method = NULL;
+
+    if (way.fieldSlot != -1) {
+        *value = instance->fields[way.fieldSlot];
+        *isMethod = false;
+    } else if (shape == NULL && tableGet(&instance->dictionary, name, value)) {
+        // Instances in dictionary mode are never cached.
+        *isMethod = false;
+        return true;
+    } else {
+        if (!findMethod(instance->klass, name, value)) return false;
+        way.method = AS_CLOSURE(*value);
+        *isMethod = true;
+    }
+
+    if (shape != NULL) updateCache(cache, way);
+    return true;
+}
+
+// `value` must still be on the stack, since adding a field can allocate.
+static void setProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value value) {
+    ObjShape* shape = instance->shape;
+    if (shape == NULL) {
+        tableSet(&instance->dictionary, name, value);
+        WRITE_BARRIER(instance);
+        return;
+    }
+
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        CacheWay* way = &cache->ways[i];
+        if (way->shape != shape) continue;
+
+        COUNT_CACHE_HIT();
+        if (way->transition != NULL) {
+            ensureFieldCapacity(instance, way->transition->fieldCount);
+            instance->fields[way->fieldSlot] = value;
+            instance->shape = way->transition;
+        } else {
+            instance->fields[way->fieldSlot] = value;
+        }
+        WRITE_BARRIER(instance);
+        return;
+    }
+
+    COUNT_CACHE_MISS();
+    CacheWay way;
+    way.shape = shape;
+    way.transition = NULL;
+    way.fieldSlot = shapeSlot(shape, name);
+    way.method = NULL;
+
+    if (way.fieldSlot == -1) {
+        way.transition = shapeTransition(shape, name);
+        way.fieldSlot = way.transition->fieldCount - 1;
+        ensureFieldCapacity(instance, way.transition->fieldCount);
+    }
+    instance->fields[way.fieldSlot] = value;
+    if (way.transition != NULL) instance->shape = way.transition;
+    WRITE_BARRIER(instance);
+
+    updateCache(cache, way);
+}
+
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -166,21 +444,29 @@ static bool invoke(ObjString* name, int argCount) {
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    bool isMethod;
+    if (!findProperty(cache, instance, name, &value, &isMethod)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    if (isMethod) {
+        COUNT_BOUND_METHOD_AVOIDED();
+        return call(AS_CLOSURE(value), argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
+    COUNT_BOUND_METHOD();
     ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
     pop();
     push(OBJ_VAL(bound));
@@ -216,6 +502,7 @@ static void closeUpvalues(Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -224,50 +511,114 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    WRITE_BARRIER(klass);
     pop();
 }
 
-static bool isFalsey(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
+// Results shorter than this are copied right away. Anything longer becomes a rope, so building a long string a piece at
+// a time doesn't copy everything built so far on every step.
+#define ROPE_MIN_LENGTH 64
 
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Value b = peek(0);
+    Value a = peek(1);
 
-    ObjString* result = takeString(chars, length);
+    Obj* result;
+    if (IS_STRING(a) && IS_STRING(b) && stringLength(a) + stringLength(b) < ROPE_MIN_LENGTH) {
+        // Build the result straight into a new string. If it turns out to be interned already, internString() frees
+        // it.
+        ObjString* string = newString(AS_STRING(a)->length + AS_STRING(b)->length);
+        memcpy(string->chars, AS_CSTRING(a), AS_STRING(a)->length);
+        memcpy(string->chars + AS_STRING(a)->length, AS_CSTRING(b), AS_STRING(b)->length);
+        result = (Obj*)internString(string);
+    } else {
+        result = (Obj*)newRope(AS_OBJ(a), AS_OBJ(b));
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame, uint8_t* ip) {
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        if (slot == frame->slots) {
+            printf(" # ");
+        }
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleChunk(
+            &frame->closure->function->chunk,
+            frame->closure->function->name == NULL ? "script" : frame->closure->function->name->chars,
+            ip
+    );
+}
+#endif
+
 static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame;
+    // The instruction pointer, the frame's stack window and its constant pool are cached in locals so the C compiler
+    // can keep them in registers instead of going through frame on every instruction. ip is only written back to the
+    // CallFrame where something else reads it: before a call pushes a new frame (we resume from frame->ip when it
+    // returns) and before anything that can report a runtime error, since the stack trace is built from frame->ip.
+    // The GC never looks at ip, so instructions that allocate don't need to store it. All three are reloaded whenever
+    // the current frame changes.
+    register uint8_t* ip;
+    register Value* slots;
+    register Value* constants;
+    // The first operand of an instruction OP_WIDE can prefix, read before the handler's shared body. `wide` tells
+    // OP_CLOSURE whether its upvalue indexes are two bytes as well.
+    int operand;
+    bool wide;
 
-#define READ_BYTE() (*frame->ip++)
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define OPERAND_CONSTANT() (constants[operand])
+#define OPERAND_STRING() AS_STRING(OPERAND_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
 
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() traceExecution(frame, ip)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef DEBUG_PRINT_STATS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() do {} while (false)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
     printf("\n=============================\n");
     printf("Start of code execution in VM. Each line will print the \n");
@@ -277,293 +628,650 @@ static InterpretResult run() {
     printf("============================\n\n");
 #endif
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            if (slot == frame->slots) {
-                printf(" # ");
-            }
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleChunk(
-                &frame->closure->function->chunk,
-                frame->closure->function->name == NULL ? "script" : frame->closure->function->name->chars,
-                frame->ip
-        );
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    // Every handler ends by jumping straight to the handler of the next instruction, so each one gets its own indirect
+    // branch (and branch predictor history) instead of all of them sharing the single jump at the top of the switch.
+    // The switch below is only used to enter the first instruction.
+    static void* dispatchTable[] = {
+            [OP_CONSTANT]      = &&TARGET_OP_CONSTANT,
+            [OP_NIL]           = &&TARGET_OP_NIL,
+            [OP_TRUE]          = &&TARGET_OP_TRUE,
+            [OP_FALSE]         = &&TARGET_OP_FALSE,
+            [OP_EQUAL]         = &&TARGET_OP_EQUAL,
+            [OP_NOT_EQUAL]     = &&TARGET_OP_NOT_EQUAL,
+            [OP_GET_SUPER]     = &&TARGET_OP_GET_SUPER,
+            [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL]    = &&TARGET_OP_SET_GLOBAL,
+            [OP_GET_GLOBAL]    = &&TARGET_OP_GET_GLOBAL,
+            [OP_GET_LOCAL]     = &&TARGET_OP_GET_LOCAL,
+            [OP_SET_LOCAL]     = &&TARGET_OP_SET_LOCAL,
+            [OP_GET_UPVALUE]   = &&TARGET_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE]   = &&TARGET_OP_SET_UPVALUE,
+            [OP_POP]           = &&TARGET_OP_POP,
+            [OP_GREATER]       = &&TARGET_OP_GREATER,
+            [OP_LESS]          = &&TARGET_OP_LESS,
+            [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+            [OP_LESS_EQUAL]    = &&TARGET_OP_LESS_EQUAL,
+            [OP_ADD]           = &&TARGET_OP_ADD,
+            [OP_SUBTRACT]      = &&TARGET_OP_SUBTRACT,
+            [OP_MULTIPLY]      = &&TARGET_OP_MULTIPLY,
+            [OP_DIVIDE]        = &&TARGET_OP_DIVIDE,
+            [OP_NOT]           = &&TARGET_OP_NOT,
+            [OP_PRINT]         = &&TARGET_OP_PRINT,
+            [OP_JUMP]          = &&TARGET_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+            [OP_NEGATE]        = &&TARGET_OP_NEGATE,
+            [OP_CALL]          = &&TARGET_OP_CALL,
+            [OP_CLOSURE]       = &&TARGET_OP_CLOSURE,
+            [OP_LOOP]          = &&TARGET_OP_LOOP,
+            [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+            [OP_RETURN]        = &&TARGET_OP_RETURN,
+            [OP_CLASS]         = &&TARGET_OP_CLASS,
+            [OP_INHERIT]       = &&TARGET_OP_INHERIT,
+            [OP_METHOD]        = &&TARGET_OP_METHOD,
+            [OP_INVOKE]        = &&TARGET_OP_INVOKE,
+            [OP_SUPER_INVOKE]  = &&TARGET_OP_SUPER_INVOKE,
+            [OP_GET_PROPERTY]  = &&TARGET_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY]  = &&TARGET_OP_SET_PROPERTY,
+            [OP_DEL_PROPERTY]  = &&TARGET_OP_DEL_PROPERTY,
+            [OP_GET_METHOD]    = &&TARGET_OP_GET_METHOD,
+            [OP_GET_SUPER_METHOD] = &&TARGET_OP_GET_SUPER_METHOD,
+            [OP_CALL_METHOD]   = &&TARGET_OP_CALL_METHOD,
+            [OP_ADD_LOCALS]    = &&TARGET_OP_ADD_LOCALS,
+            [OP_ADD_CONSTANT]  = &&TARGET_OP_ADD_CONSTANT,
+            [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+            [OP_LESS_JUMP_IF_FALSE] = &&TARGET_OP_LESS_JUMP_IF_FALSE,
+            [OP_WIDE]          = &&TARGET_OP_WIDE,
+#ifdef REGISTER_BYTECODE
+            [OP_MOVE]          = &&TARGET_OP_MOVE,
+            [OP_LOAD_CONSTANT] = &&TARGET_OP_LOAD_CONSTANT,
+            [OP_ADD_RR]        = &&TARGET_OP_ADD_RR,
+            [OP_ADD_RK]        = &&TARGET_OP_ADD_RK,
+            [OP_SUBTRACT_RR]   = &&TARGET_OP_SUBTRACT_RR,
+            [OP_SUBTRACT_RK]   = &&TARGET_OP_SUBTRACT_RK,
+            [OP_MULTIPLY_RR]   = &&TARGET_OP_MULTIPLY_RR,
+            [OP_MULTIPLY_RK]   = &&TARGET_OP_MULTIPLY_RK,
+            [OP_DIVIDE_RR]     = &&TARGET_OP_DIVIDE_RR,
+            [OP_DIVIDE_RK]     = &&TARGET_OP_DIVIDE_RK,
+            [OP_ADD_RR_SET]      = &&TARGET_OP_ADD_RR_SET,
+            [OP_ADD_RK_SET]      = &&TARGET_OP_ADD_RK_SET,
+            [OP_SUBTRACT_RR_SET] = &&TARGET_OP_SUBTRACT_RR_SET,
+            [OP_SUBTRACT_RK_SET] = &&TARGET_OP_SUBTRACT_RK_SET,
+            [OP_MULTIPLY_RR_SET] = &&TARGET_OP_MULTIPLY_RR_SET,
+            [OP_MULTIPLY_RK_SET] = &&TARGET_OP_MULTIPLY_RK_SET,
+            [OP_DIVIDE_RR_SET]   = &&TARGET_OP_DIVIDE_RR_SET,
+            [OP_DIVIDE_RK_SET]   = &&TARGET_OP_DIVIDE_RK_SET,
+            [OP_EQUAL_RR_JUMP_IF_FALSE]         = &&TARGET_OP_EQUAL_RR_JUMP_IF_FALSE,
+            [OP_EQUAL_RK_JUMP_IF_FALSE]         = &&TARGET_OP_EQUAL_RK_JUMP_IF_FALSE,
+            [OP_NOT_EQUAL_RR_JUMP_IF_FALSE]     = &&TARGET_OP_NOT_EQUAL_RR_JUMP_IF_FALSE,
+            [OP_NOT_EQUAL_RK_JUMP_IF_FALSE]     = &&TARGET_OP_NOT_EQUAL_RK_JUMP_IF_FALSE,
+            [OP_LESS_RR_JUMP_IF_FALSE]          = &&TARGET_OP_LESS_RR_JUMP_IF_FALSE,
+            [OP_LESS_RK_JUMP_IF_FALSE]          = &&TARGET_OP_LESS_RK_JUMP_IF_FALSE,
+            [OP_LESS_EQUAL_RR_JUMP_IF_FALSE]    = &&TARGET_OP_LESS_EQUAL_RR_JUMP_IF_FALSE,
+            [OP_LESS_EQUAL_RK_JUMP_IF_FALSE]    = &&TARGET_OP_LESS_EQUAL_RK_JUMP_IF_FALSE,
+            [OP_GREATER_RR_JUMP_IF_FALSE]       = &&TARGET_OP_GREATER_RR_JUMP_IF_FALSE,
+            [OP_GREATER_RK_JUMP_IF_FALSE]       = &&TARGET_OP_GREATER_RK_JUMP_IF_FALSE,
+            [OP_GREATER_EQUAL_RR_JUMP_IF_FALSE] = &&TARGET_OP_GREATER_EQUAL_RR_JUMP_IF_FALSE,
+            [OP_GREATER_EQUAL_RK_JUMP_IF_FALSE] = &&TARGET_OP_GREATER_EQUAL_RK_JUMP_IF_FALSE,
+#endif
+    };
+
+#define CASE(op) case op: TARGET_##op
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+// The usual one-byte operand is read on the way in, and OP_WIDE jumps past that read to the WIDE_ label with a
+// two-byte operand instead, so the common case costs nothing extra.
+#define WIDE_CASE(op) CASE(op): operand = READ_BYTE(); WIDE_##op
+
+#ifdef REGISTER_BYTECODE
+// The register instructions (see translateRegisters() in peephole.c) read the right operand `right`, either
+// READ_SLOT() or READ_CONSTANT(), after the result slot and the left operand's slot. Those that `keep` their result
+// leave it as the new top of the stack.
+#define READ_SLOT() (slots[READ_BYTE()])
+#define REGISTER_BINARY_OP(op, right, keep) \
+    do { \
+        uint8_t result = READ_BYTE(); \
+        Value a = READ_SLOT(); \
+        Value b = right; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        slots[result] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        if (keep) vm.stackTop = slots + result + 1; \
+    } while (false)
+// Concatenation can trigger a collection, so the operands go on the stack for it like OP_ADD's. Everything under the
+// result slot is live by then.
+#define REGISTER_ADD(right, keep) \
+    do { \
+        uint8_t result = READ_BYTE(); \
+        Value a = READ_SLOT(); \
+        Value b = right; \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            slots[result] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+            if (keep) vm.stackTop = slots + result + 1; \
+        } else if (isStringOrRope(a) && isStringOrRope(b)) { \
+            if (keep) vm.stackTop = slots + result; \
+            push(a); \
+            push(b); \
+            concatenate(); \
+            if (!keep) slots[result] = pop(); \
+        } else { \
+            RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+        } \
+    } while (false)
+// The false result is pushed when jumping, as the code at the target expects it the way OP_LESS_JUMP_IF_FALSE does.
+// Their operands are always locals or constants, so they're already rooted if comparing flattens a rope.
+#define REGISTER_COMPARE_JUMP(op, right) \
+    do { \
+        Value a = READ_SLOT(); \
+        Value b = right; \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        if (!(AS_NUMBER(a) op AS_NUMBER(b))) { \
+            push(BOOL_VAL(false)); \
+            ip += offset; \
+        } \
+    } while (false)
+#define REGISTER_EQUAL_JUMP(right, equal) \
+    do { \
+        Value a = READ_SLOT(); \
+        Value b = right; \
+        uint16_t offset = READ_SHORT(); \
+        if (valuesEqual(a, b) != equal) { \
+            push(BOOL_VAL(false)); \
+            ip += offset; \
+        } \
+    } while (false)
 #endif
+
+    for (;;) {
+        TRACE_EXECUTION();
+        COUNT_INSTRUCTION();
         switch (READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
+            WIDE_CASE(OP_CONSTANT): {
+                Value constant = OPERAND_CONSTANT();
                 push(constant);
-                break;
+                DISPATCH();
             }
-            case OP_NIL:
+            CASE(OP_NIL):
                 push(NIL_VAL);
-                break;
-            case OP_TRUE:
+                DISPATCH();
+            CASE(OP_TRUE):
                 push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
+                DISPATCH();
+            CASE(OP_FALSE):
                 push(BOOL_VAL(false));
-                break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                DISPATCH();
+            CASE(OP_POP): pop(); DISPATCH();
+            WIDE_CASE(OP_GET_LOCAL): {
+                push(slots[operand]);
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            WIDE_CASE(OP_SET_LOCAL): {
+                slots[operand] = peek(0);
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_GLOBAL): {
+                int slot = READ_SHORT();
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                 }
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
+            // Globals are roots that every collection traces, so storing to one needs no write barrier.
+            CASE(OP_DEFINE_GLOBAL): {
+                vm.globalValues.values[READ_SHORT()] = peek(0);
                 pop();
-                break;
+                DISPATCH();
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_GLOBAL): {
+                int slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                 }
-                break;
+                vm.globalValues.values[slot] = peek(0);
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
+            WIDE_CASE(OP_GET_PROPERTY): {
                 if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+                ObjString* name = OPERAND_STRING();
+                InlineCache* cache = READ_CACHE();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
+                bool isMethod;
+                if (!findProperty(cache, instance, name, &value, &isMethod)) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
                 }
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (isMethod) {
+                    COUNT_BOUND_METHOD();
+                    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(value));
+                    value = OBJ_VAL(bound);
                 }
-                break;
+                pop(); // Instance.
+                push(value);
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
+            WIDE_CASE(OP_SET_PROPERTY): {
                 if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = OPERAND_STRING();
+                setProperty(READ_CACHE(), instance, name, peek(0));
                 Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_DEL_PROPERTY: {
+            WIDE_CASE(OP_DEL_PROPERTY): {
                 if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+                ObjString* name = OPERAND_STRING();
 
-                tableDelete(&instance->fields, name);
+                deleteField(instance, name);
                 pop(); // Instance.
 
-                break;
+                DISPATCH();
+            }
+            // The operands stay on the stack while they're compared, because comparing a rope flattens it, which can
+            // trigger a collection.
+            CASE(OP_EQUAL): {
+                bool equal = valuesEqual(peek(1), peek(0));
+                vm.stackTop -= 2;
+                push(BOOL_VAL(equal));
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            CASE(OP_NOT_EQUAL): {
+                bool equal = valuesEqual(peek(1), peek(0));
+                vm.stackTop -= 2;
+                push(BOOL_VAL(!equal));
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
+            WIDE_CASE(OP_GET_SUPER): {
+                ObjString* name = OPERAND_STRING();
                 ObjClass* superclass = AS_CLASS(pop());
 
+                STORE_FRAME();
                 if (!bindMethod(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                DISPATCH();
+            }
+            // OP_GET_METHOD and OP_GET_SUPER_METHOD are the gets in `(object.method)(...)` and `(super.method)(...)`,
+            // see grouping() in compiler.c. Instead of binding a method they leave it on the stack under its receiver,
+            // [method][receiver], for OP_CALL_METHOD to call once the arguments are on top. A field holds no method,
+            // so it's left as [value][UNDEFINED] and called like any other value.
+            WIDE_CASE(OP_GET_METHOD): {
+                if (!IS_INSTANCE(peek(0))) {
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjString* name = OPERAND_STRING();
+                InlineCache* cache = READ_CACHE();
+
+                Value value;
+                bool isMethod;
+                if (!findProperty(cache, instance, name, &value, &isMethod)) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                }
+
+                vm.stackTop[-1] = value;
+                push(isMethod ? OBJ_VAL(instance) : UNDEFINED_VAL);
+                DISPATCH();
+            }
+            WIDE_CASE(OP_GET_SUPER_METHOD): {
+                ObjString* name = OPERAND_STRING();
+                Value method;
+                if (!findMethod(AS_CLASS(peek(0)), name, &method)) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                }
+
+                pop(); // Superclass.
+                Value receiver = peek(0);
+                vm.stackTop[-1] = method;
+                push(receiver);
+                DISPATCH();
+            }
+            CASE(OP_CALL_METHOD): {
+                int argCount = READ_BYTE();
+                Value callee = peek(argCount + 1);
+                Value receiver = peek(argCount);
+
+                // Close up the extra slot, so the stack looks like any other call: [callee or receiver][arguments].
+                Value* base = vm.stackTop - argCount - 2;
+                memmove(base + 1, base + 2, sizeof(Value) * argCount);
+                vm.stackTop--;
+
+                STORE_FRAME();
+                bool ok;
+                if (IS_UNDEFINED(receiver)) {
+                    *base = callee;
+                    ok = callValue(callee, argCount);
+                } else {
+                    COUNT_BOUND_METHOD_AVOIDED();
+                    *base = receiver;
+                    ok = call(AS_CLOSURE(callee), argCount);
+                }
+                if (!ok) return INTERPRET_RUNTIME_ERROR;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_NEGATE:
+            CASE(OP_NEGATE):
                 if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                DISPATCH();
+            CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+            CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+            // These used to be compiled as the negation of the opposite comparison, which gave the wrong answer for
+            // NaN: NaN <= x must be false, but !(NaN > x) is true.
+            CASE(OP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); DISPATCH();
+            CASE(OP_LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=); DISPATCH();
+            CASE(OP_ADD): {
+                if (isStringOrRope(peek(0)) && isStringOrRope(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
+                DISPATCH();
             }
-            case OP_SUBTRACT:
+            CASE(OP_SUBTRACT):
                 BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
+                DISPATCH();
+            CASE(OP_MULTIPLY):
                 BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
+                DISPATCH();
+            CASE(OP_DIVIDE):
                 BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
+                DISPATCH();
+            CASE(OP_NOT):
                 push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_PRINT: {
+                DISPATCH();
+            CASE(OP_PRINT): {
+                if (IS_ROPE(peek(0))) flattenRope(AS_ROPE(peek(0)));
                 printValue(pop());
                 printf("\n");
-                break;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                if (isFalsey(peek(0))) ip += offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                ip -= offset;
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(OP_CALL): {
                 int argCount = READ_BYTE();
+                STORE_FRAME();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            WIDE_CASE(OP_GET_UPVALUE): {
+                push(*frame->closure->upvalues[operand]->location);
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            WIDE_CASE(OP_SET_UPVALUE): {
+                ObjUpvalue* upvalue = frame->closure->upvalues[operand];
+                *upvalue->location = peek(0);
+                WRITE_BARRIER(upvalue);
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
+            WIDE_CASE(OP_SUPER_INVOKE): {
+                ObjString* method = OPERAND_STRING();
                 int argCount = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(pop());
+                STORE_FRAME();
                 if (!invokeFromClass(superclass, method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            CASE(OP_CLOSURE):
+                operand = READ_BYTE();
+                wide = false;
+            WIDE_OP_CLOSURE: {
+                ObjFunction* function = AS_FUNCTION(OPERAND_CONSTANT());
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                    int index = wide ? READ_SHORT() : READ_BYTE();
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = captureUpvalue(slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    WRITE_BARRIER(closure);
                 }
-                break;
+                DISPATCH();
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+            WIDE_CASE(OP_INVOKE): {
+                ObjString* method = OPERAND_STRING();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                InlineCache* cache = READ_CACHE();
+                STORE_FRAME();
+                if (!invoke(method, argCount, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE):
                 closeUpvalues(vm.stackTop - 1);
                 pop();
-                break;
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
+                DISPATCH();
+            WIDE_CASE(OP_CLASS):
+                push(OBJ_VAL(newClass(OPERAND_STRING())));
+                DISPATCH();
+            CASE(OP_INHERIT): {
                 Value superclass = peek(1);
                 if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
 
                 ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                subclass->superclass = AS_CLASS(superclass);
+                WRITE_BARRIER(subclass);
                 pop(); // Subclass.
-                break;
+                DISPATCH();
+            }
+            WIDE_CASE(OP_METHOD):
+                defineMethod(OPERAND_STRING());
+                DISPATCH();
+            CASE(OP_ADD_LOCALS): {
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                    DISPATCH();
+                }
+
+                push(a);
+                push(b);
+                if (isStringOrRope(a) && isStringOrRope(b)) {
+                    concatenate();
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
+            }
+            CASE(OP_ADD_CONSTANT): {
+                Value b = READ_CONSTANT();
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(b)) {
+                    vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + AS_NUMBER(b));
+                    DISPATCH();
+                }
+
+                push(b);
+                if (isStringOrRope(peek(0)) && isStringOrRope(peek(1))) {
+                    concatenate();
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
-            case OP_RETURN: {
+            CASE(OP_SET_LOCAL_POP): {
+                uint8_t slot = READ_BYTE();
+                slots[slot] = pop();
+                DISPATCH();
+            }
+            CASE(OP_LESS_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                // The code at the jump target expects the condition to still be on the stack, the way the
+                // OP_JUMP_IF_FALSE this replaced left it.
+                if (!(a < b)) {
+                    push(BOOL_VAL(false));
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(OP_WIDE):
+                switch (READ_BYTE()) {
+                    case OP_CONSTANT:         operand = READ_SHORT(); goto WIDE_OP_CONSTANT;
+                    case OP_GET_LOCAL:        operand = READ_SHORT(); goto WIDE_OP_GET_LOCAL;
+                    case OP_SET_LOCAL:        operand = READ_SHORT(); goto WIDE_OP_SET_LOCAL;
+                    case OP_GET_UPVALUE:      operand = READ_SHORT(); goto WIDE_OP_GET_UPVALUE;
+                    case OP_SET_UPVALUE:      operand = READ_SHORT(); goto WIDE_OP_SET_UPVALUE;
+                    case OP_GET_PROPERTY:     operand = READ_SHORT(); goto WIDE_OP_GET_PROPERTY;
+                    case OP_SET_PROPERTY:     operand = READ_SHORT(); goto WIDE_OP_SET_PROPERTY;
+                    case OP_DEL_PROPERTY:     operand = READ_SHORT(); goto WIDE_OP_DEL_PROPERTY;
+                    case OP_GET_METHOD:       operand = READ_SHORT(); goto WIDE_OP_GET_METHOD;
+                    case OP_GET_SUPER:        operand = READ_SHORT(); goto WIDE_OP_GET_SUPER;
+                    case OP_GET_SUPER_METHOD: operand = READ_SHORT(); goto WIDE_OP_GET_SUPER_METHOD;
+                    case OP_INVOKE:           operand = READ_SHORT(); goto WIDE_OP_INVOKE;
+                    case OP_SUPER_INVOKE:     operand = READ_SHORT(); goto WIDE_OP_SUPER_INVOKE;
+                    case OP_CLASS:            operand = READ_SHORT(); goto WIDE_OP_CLASS;
+                    case OP_METHOD:           operand = READ_SHORT(); goto WIDE_OP_METHOD;
+                    case OP_CLOSURE:          operand = READ_SHORT(); wide = true; goto WIDE_OP_CLOSURE;
+                    default:
+                        RUNTIME_ERROR("Unknown wide instruction.");
+                }
+#ifdef REGISTER_BYTECODE
+            CASE(OP_MOVE): {
+                uint8_t local = READ_BYTE();
+                slots[local] = READ_SLOT();
+                DISPATCH();
+            }
+            CASE(OP_LOAD_CONSTANT): {
+                uint8_t local = READ_BYTE();
+                slots[local] = READ_CONSTANT();
+                DISPATCH();
+            }
+            CASE(OP_ADD_RR):          REGISTER_ADD(READ_SLOT(), true); DISPATCH();
+            CASE(OP_ADD_RK):          REGISTER_ADD(READ_CONSTANT(), true); DISPATCH();
+            CASE(OP_SUBTRACT_RR):     REGISTER_BINARY_OP(-, READ_SLOT(), true); DISPATCH();
+            CASE(OP_SUBTRACT_RK):     REGISTER_BINARY_OP(-, READ_CONSTANT(), true); DISPATCH();
+            CASE(OP_MULTIPLY_RR):     REGISTER_BINARY_OP(*, READ_SLOT(), true); DISPATCH();
+            CASE(OP_MULTIPLY_RK):     REGISTER_BINARY_OP(*, READ_CONSTANT(), true); DISPATCH();
+            CASE(OP_DIVIDE_RR):       REGISTER_BINARY_OP(/, READ_SLOT(), true); DISPATCH();
+            CASE(OP_DIVIDE_RK):       REGISTER_BINARY_OP(/, READ_CONSTANT(), true); DISPATCH();
+            CASE(OP_ADD_RR_SET):      REGISTER_ADD(READ_SLOT(), false); DISPATCH();
+            CASE(OP_ADD_RK_SET):      REGISTER_ADD(READ_CONSTANT(), false); DISPATCH();
+            CASE(OP_SUBTRACT_RR_SET): REGISTER_BINARY_OP(-, READ_SLOT(), false); DISPATCH();
+            CASE(OP_SUBTRACT_RK_SET): REGISTER_BINARY_OP(-, READ_CONSTANT(), false); DISPATCH();
+            CASE(OP_MULTIPLY_RR_SET): REGISTER_BINARY_OP(*, READ_SLOT(), false); DISPATCH();
+            CASE(OP_MULTIPLY_RK_SET): REGISTER_BINARY_OP(*, READ_CONSTANT(), false); DISPATCH();
+            CASE(OP_DIVIDE_RR_SET):   REGISTER_BINARY_OP(/, READ_SLOT(), false); DISPATCH();
+            CASE(OP_DIVIDE_RK_SET):   REGISTER_BINARY_OP(/, READ_CONSTANT(), false); DISPATCH();
+            CASE(OP_EQUAL_RR_JUMP_IF_FALSE):         REGISTER_EQUAL_JUMP(READ_SLOT(), true); DISPATCH();
+            CASE(OP_EQUAL_RK_JUMP_IF_FALSE):         REGISTER_EQUAL_JUMP(READ_CONSTANT(), true); DISPATCH();
+            CASE(OP_NOT_EQUAL_RR_JUMP_IF_FALSE):     REGISTER_EQUAL_JUMP(READ_SLOT(), false); DISPATCH();
+            CASE(OP_NOT_EQUAL_RK_JUMP_IF_FALSE):     REGISTER_EQUAL_JUMP(READ_CONSTANT(), false); DISPATCH();
+            CASE(OP_LESS_RR_JUMP_IF_FALSE):          REGISTER_COMPARE_JUMP(<, READ_SLOT()); DISPATCH();
+            CASE(OP_LESS_RK_JUMP_IF_FALSE):          REGISTER_COMPARE_JUMP(<, READ_CONSTANT()); DISPATCH();
+            CASE(OP_LESS_EQUAL_RR_JUMP_IF_FALSE):    REGISTER_COMPARE_JUMP(<=, READ_SLOT()); DISPATCH();
+            CASE(OP_LESS_EQUAL_RK_JUMP_IF_FALSE):    REGISTER_COMPARE_JUMP(<=, READ_CONSTANT()); DISPATCH();
+            CASE(OP_GREATER_RR_JUMP_IF_FALSE):       REGISTER_COMPARE_JUMP(>, READ_SLOT()); DISPATCH();
+            CASE(OP_GREATER_RK_JUMP_IF_FALSE):       REGISTER_COMPARE_JUMP(>, READ_CONSTANT()); DISPATCH();
+            CASE(OP_GREATER_EQUAL_RR_JUMP_IF_FALSE): REGISTER_COMPARE_JUMP(>=, READ_SLOT()); DISPATCH();
+            CASE(OP_GREATER_EQUAL_RK_JUMP_IF_FALSE): REGISTER_COMPARE_JUMP(>=, READ_CONSTANT()); DISPATCH();
+#endif
+            CASE(OP_RETURN): {
                 Value result = pop();
-                closeUpvalues(frame->slots);
+                closeUpvalues(slots);
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
                     pop();
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
+                vm.stackTop = slots;
                 push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
         }
     }
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef CASE
+#undef WIDE_CASE
+#undef READ_SLOT
+#undef REGISTER_BINARY_OP
+#undef REGISTER_ADD
+#undef REGISTER_COMPARE_JUMP
+#undef REGISTER_EQUAL_JUMP
+#undef DISPATCH
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
 #undef READ_BYTE
 #undef BINARY_OP
-#undef READ_STRING
+#undef OPERAND_STRING
+#undef OPERAND_CONSTANT
+#undef READ_CACHE
 #undef READ_CONSTANT
 #undef READ_SHORT
 }
 
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+static InterpretResult runScript(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
@@ -572,3 +1280,23 @@ InterpretResult interpret(const char* source) {
 
     return run();
 }
+
+InterpretResult interpret(const char* source) {
+    ObjFunction* function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+    return runScript(function);
+}
+
+// Like interpret(), but loads the script from the image at imagePath if it was compiled from this same source. If not,
+// the script is compiled and the image written for next time. Not being able to write it isn't an error.
+InterpretResult interpretCached(const char* source, const char* imagePath) {
+    ObjFunction* function = readImage(imagePath, source);
+    if (function == NULL) {
+        function = compile(source);
+        if (function == NULL) return INTERPRET_COMPILE_ERROR;
+        writeImage(imagePath, function, source);
+    }
+
+    return runScript(function);
+}
@@ -9,8 +9,14 @@
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The value stack and the call frames start out small and grow as calls need them, so the only limit on recursion is
+// this cap on how deeply calls can nest, past which a call fails with "Stack overflow.". Build with -DFRAMES_MAX=n to
+// change it.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 100000
+#endif
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
 
 typedef struct {
     ObjClosure* closure;
@@ -18,22 +24,58 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GCPhase;
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    Value* stackLimit; // One past the end of the stack.
+    // Every global variable gets a slot in globalValues the first time the compiler sees its name, and the bytecode
+    // refers to it by that index. globalSlots maps a name to its index and globalNames maps it back, for error
+    // messages. A slot holds UNDEFINED_VAL until the global's declaration runs.
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
     Table strings;
     ObjString* initString;
     ObjUpvalue* openUpvalues;
 
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+    size_t nextMajorGC;
+    size_t oldBytes; // The heap size right after the last collection.
+    Obj* objects;    // Young objects, allocated since the last collection.
+    Obj* oldObjects; // Objects that have survived a collection.
+    GCPhase gcPhase;
+    uint8_t markEpoch;
+    Obj** sweepCursor;     // The link to the next old object to sweep.
+    Obj* sweepingObjects;  // Young objects still to be swept.
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+
+#ifdef DEBUG_PRINT_STATS
+    uint64_t instructionCount;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t boundMethods;        // ObjBoundMethods allocated...
+    uint64_t boundMethodsAvoided; // ...and method calls that got by without one.
+    uint64_t minorCollections;
+    uint64_t majorCollections;
+    uint64_t gcPauses;
+    double gcSeconds;
+    double gcMaxPause;
+#endif
 } VM;
 
 typedef enum {
@@ -47,8 +89,10 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretCached(const char* source, const char* imagePath);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);
 
 
 #endif //CLOX_VM_H